@@ -38,16 +38,18 @@ int processx__stdio_verify(BYTE* buffer, WORD size) {
   return 1;
 }
 
-void processx__stdio_noinherit(BYTE* buffer) {
-  int i, count;
+int processx__stdio_noinherit(BYTE* buffer) {
+  int i, count, done = 0;
 
   count = CHILD_STDIO_COUNT(buffer);
   for (i = 0; i < count; i++) {
     HANDLE handle = CHILD_STDIO_HANDLE(buffer, i);
     if (handle != INVALID_HANDLE_VALUE) {
-      SetHandleInformation(handle, HANDLE_FLAG_INHERIT, 0);
+      if (SetHandleInformation(handle, HANDLE_FLAG_INHERIT, 0)) done++;
     }
   }
+
+  return done;
 }
 
 /*
@@ -60,30 +62,31 @@ void processx__stdio_noinherit(BYTE* buffer) {
 SEXP processx_disable_inheritance(void) {
   HANDLE handle;
   STARTUPINFOW si;
+  int count = 0;
 
   /* Make the windows stdio handles non-inheritable. */
   handle = GetStdHandle(STD_INPUT_HANDLE);
   if (handle != NULL && handle != INVALID_HANDLE_VALUE) {
-    SetHandleInformation(handle, HANDLE_FLAG_INHERIT, 0);
+    if (SetHandleInformation(handle, HANDLE_FLAG_INHERIT, 0)) count++;
   }
 
   handle = GetStdHandle(STD_OUTPUT_HANDLE);
   if (handle != NULL && handle != INVALID_HANDLE_VALUE) {
-    SetHandleInformation(handle, HANDLE_FLAG_INHERIT, 0);
+    if (SetHandleInformation(handle, HANDLE_FLAG_INHERIT, 0)) count++;
   }
 
   handle = GetStdHandle(STD_ERROR_HANDLE);
   if (handle != NULL && handle != INVALID_HANDLE_VALUE) {
-    SetHandleInformation(handle, HANDLE_FLAG_INHERIT, 0);
+    if (SetHandleInformation(handle, HANDLE_FLAG_INHERIT, 0)) count++;
   }
 
   /* Make inherited CRT FDs non-inheritable. */
   GetStartupInfoW(&si);
   if (processx__stdio_verify(si.lpReserved2, si.cbReserved2)) {
-    processx__stdio_noinherit(si.lpReserved2);
+    count += processx__stdio_noinherit(si.lpReserved2);
   }
 
-  return R_NilValue;
+  return ScalarInteger(count);
 }
 
 SEXP processx_write(SEXP fd, SEXP data) {
@@ -105,11 +108,28 @@ SEXP processx_write(SEXP fd, SEXP data) {
 #include <stdlib.h>
 #include <signal.h>
 #include <string.h>
+#include <dirent.h>
 
 #include <R_ext/Rdynload.h>
 #include <Rinternals.h>
 #include "errors.h"
 
+#if defined(__linux__)
+#include <sys/syscall.h>
+#define PROCESSX__FD_DIR "/proc/self/fd"
+#if defined(SYS_close_range)
+#define PROCESSX__NR_CLOSE_RANGE SYS_close_range
+#elif !defined(__alpha__)
+#define PROCESSX__NR_CLOSE_RANGE 436
+#endif
+#else
+#define PROCESSX__FD_DIR "/dev/fd"
+#endif
+
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
 static int processx__cloexec_fcntl(int fd, int set) {
   int flags;
   int r;
@@ -128,22 +148,65 @@ static int processx__cloexec_fcntl(int fd, int set) {
   return 0;
 }
 
+/* Same as processx__cloexec_all_fds() in unix/utils.c */
+
+static int processx__cloexec_all_fds(int firstfd) {
+  int done = 0, count = 0, seen_self = 0, fd, dfd;
+  DIR *dir;
+  struct dirent *ent;
+  const char *c;
+
+#ifdef PROCESSX__NR_CLOSE_RANGE
+  done = syscall(PROCESSX__NR_CLOSE_RANGE, firstfd, ~0U,
+                 CLOSE_RANGE_CLOEXEC) == 0;
+#endif
+
+  dir = opendir(PROCESSX__FD_DIR);
+  if (dir) {
+    dfd = dirfd(dir);
+    while ((ent = readdir(dir)) != NULL) {
+      if (ent->d_name[0] < '0' || ent->d_name[0] > '9') continue;
+      for (fd = 0, c = ent->d_name; *c >= '0' && *c <= '9'; c++) {
+        fd = fd * 10 + (*c - '0');
+      }
+      if (fd == dfd) {
+        seen_self = 1;
+        continue;
+      }
+      if (fd < firstfd) continue;
+      if (done || processx__cloexec_fcntl(fd, 1) == 0) count++;
+    }
+    closedir(dir);
+    if (seen_self) return count;
+  }
+
+  if (done) return -1;
+
+  count = 0;
+  for (fd = firstfd; ; fd++) {
+    if (processx__cloexec_fcntl(fd, 1)) {
+      if (fd > 15) break;
+    } else {
+      count++;
+    }
+  }
+
+  return count;
+}
+
 SEXP processx_disable_inheritance(void) {
-  int fd;
+  int count;
 
-  /* Set the CLOEXEC flag on all open descriptors. Unconditionally try the
-   * first 16 file descriptors. After that, bail out after the first error.
+  /* Set the CLOEXEC flag on all open descriptors.
    * We skip the standard streams, because R and `system()` is not prepared
    * to not inheriting stdin and eg. an R subprocess does not even start in
    * system(). See https://github.com/r-lib/callr/issues/236. */
 
   int firstfd = 3;
   if (getenv("PROCESSX_CLOEXEC_STDIO")) firstfd = 0;
-  for (fd = firstfd; ; fd++) {
-    if (processx__cloexec_fcntl(fd, 1) && fd > 15) break;
-  }
+  count = processx__cloexec_all_fds(firstfd);
 
-  return R_NilValue;
+  return ScalarInteger(count < 0 ? NA_INTEGER : count);
 }
 
 SEXP processx_write(SEXP fd, SEXP data) {
@@ -0,0 +1,265 @@
+// The processx fork server. processx starts this program early, while the
+// R process is still small, and then sends it requests to start
+// subprocesses. This way the cost of starting a subprocess does not depend
+// on the size of the R process.
+//
+// The server receives its end of a unix socket as fd 3. Every request has
+// the command, its arguments, environment, working directory and the
+// redirections of the child, and the fds of the child are passed with
+// SCM_RIGHTS. See `unix/child.h` for the protocol. The child is started
+// with CLONE_PARENT, so it is the child of the R process, not ours. R can
+// wait for it, and it gets the SIGCHLD when the child exits.
+//
+// The server quits when the socket is closed, i.e. when processx stops it,
+// or when the R process exits.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "../unix/child.h"
+
+#ifdef __linux__
+#include <sched.h>
+
+// Constants ------------------------------------------------------------------
+
+// The socket that we get from processx
+#define SERVER_FD 3
+// Stack size for the clone()-d children, they only exec
+#define STACK_SIZE (128 * 1024)
+// Maximum size of a single request
+#define MAX_PAYLOAD (64 * 1024 * 1024)
+
+// Reading the payload --------------------------------------------------------
+
+typedef struct {
+  char *ptr;
+  char *end;
+  int error;
+} reader_t;
+
+static int read_int(reader_t *rd) {
+  int32_t x = 0;
+  if (rd->end - rd->ptr < (ptrdiff_t) sizeof(x)) {
+    rd->error = 1;
+    return 0;
+  }
+  memcpy(&x, rd->ptr, sizeof(x));
+  rd->ptr += sizeof(x);
+  return x;
+}
+
+// Empty strings are NULL, if `empty_null` is set.
+static char *read_str(reader_t *rd, int empty_null) {
+  char *str = rd->ptr;
+  char *zero = memchr(rd->ptr, '\0', rd->end - rd->ptr);
+  if (!zero) {
+    rd->error = 1;
+    return NULL;
+  }
+  rd->ptr = zero + 1;
+  return (empty_null && str[0] == '\0') ? NULL : str;
+}
+
+static char **read_strs(reader_t *rd) {
+  int i, n = read_int(rd);
+  char **res;
+  if (rd->error || n < 0 || n > rd->end - rd->ptr) {
+    rd->error = 1;
+    return NULL;
+  }
+  res = calloc(n + 1, sizeof(char*));
+  if (!res) {
+    rd->error = 1;
+    return NULL;
+  }
+  for (i = 0; i < n; i++) res[i] = read_str(rd, 0);
+  return res;
+}
+
+// Receiving a request ---------------------------------------------------------
+
+static ssize_t recv_all(int fd, void *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t ret = recv(fd, (char*) buf + done, len - done, 0);
+    if (ret == -1 && errno == EINTR) continue;
+    if (ret <= 0) return ret;
+    done += ret;
+  }
+  return done;
+}
+
+// Returns 0 on EOF, -1 on error, 1 if we have a request
+static int recv_request(int sock, char **payload, size_t *len,
+                        int *fds, int *nfds) {
+  uint32_t header[2];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * PROCESSX__FORKSERVER_MAX_FDS)];
+  } cmsgbuf;
+  ssize_t ret;
+
+  *nfds = 0;
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = header;
+  iov.iov_len = sizeof(header);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsgbuf.buf;
+  msg.msg_controllen = sizeof(cmsgbuf.buf);
+
+  do {
+    ret = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+  } while (ret == -1 && errno == EINTR);
+  if (ret == 0) return 0;
+  if (ret == -1) return -1;
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      *nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *nfds);
+    }
+  }
+
+  if (ret != sizeof(header) ||
+      header[0] != PROCESSX__FORKSERVER_MAGIC ||
+      header[1] > MAX_PAYLOAD) {
+    return -1;
+  }
+
+  *len = header[1];
+  *payload = malloc(*len);
+  if (!*payload) return -1;
+  if (recv_all(sock, *payload, *len) != (ssize_t) *len) return -1;
+
+  return 1;
+}
+
+// Starting the child ---------------------------------------------------------
+
+static pid_t start_child(reader_t *rd, int *fds, int nfds, char *stack) {
+  processx__child_args_t child;
+  int i, idx, nargs;
+  pid_t pid;
+
+  memset(&child, 0, sizeof(child));
+  child.stdio_count = read_int(rd);
+  child.pty_echo = read_int(rd);
+  child.pty_rows = read_int(rd);
+  child.pty_cols = read_int(rd);
+  if (rd->error || child.stdio_count < 0 ||
+      child.stdio_count >= PROCESSX__FORKSERVER_MAX_FDS || nfds < 1) {
+    return -EINVAL;
+  }
+
+  child.fds = calloc(child.stdio_count + 1, sizeof(int));
+  child.modes = calloc(child.stdio_count + 1, sizeof(int));
+  child.files = calloc(child.stdio_count + 1, sizeof(char*));
+  if (!child.fds || !child.modes || !child.files) return -ENOMEM;
+
+  for (i = 0; i < child.stdio_count; i++) {
+    idx = read_int(rd);
+    child.fds[i] = (idx >= 0 && idx < nfds) ? fds[idx] : -1;
+    child.modes[i] = read_int(rd);
+    child.files[i] = read_str(rd, 1);
+  }
+  child.command = read_str(rd, 0);
+  child.cwd = read_str(rd, 1);
+  child.wd = read_str(rd, 1);
+  child.pty_name = read_str(rd, 1);
+  child.args = read_strs(rd);
+  child.env = read_strs(rd);
+  if (rd->error) return -EINVAL;
+
+  for (nargs = 0; child.args[nargs]; nargs++) ;
+  child.sh_args = calloc(nargs + 2, sizeof(char*));
+  if (!child.sh_args) return -ENOMEM;
+  child.sh_args[0] = "/bin/sh";
+  for (i = 1; i <= nargs; i++) child.sh_args[i + 1] = child.args[i];
+
+  child.path = processx__child_path(child.env);
+  child.error_fd = fds[0];
+  child.max_fd = processx__child_max_fd();
+  child.pty_main_fd = -1;
+  sigemptyset(&child.sigmask);
+
+  pid = clone(processx__child_start, stack + STACK_SIZE,
+              CLONE_VM | CLONE_VFORK | CLONE_PARENT | SIGCHLD, &child);
+  if (pid == -1) pid = -errno;
+
+  free(child.fds);
+  free(child.modes);
+  free(child.files);
+  free(child.args);
+  free(child.env);
+  free(child.sh_args);
+
+  return pid;
+}
+
+#endif
+
+// Main -----------------------------------------------------------------------
+
+int main(int argc, char **argv) {
+#ifndef __linux__
+  fprintf(stderr, "The processx fork server is only supported on Linux\n");
+  return 1;
+#else
+  int fds[PROCESSX__FORKSERVER_MAX_FDS];
+  int nfds, i, ret;
+  char *payload;
+  size_t len;
+  int32_t reply = 0;
+  uint32_t hello = PROCESSX__FORKSERVER_MAGIC;
+  char *stack = malloc(STACK_SIZE);
+  reader_t rd;
+
+  if (!stack) return 2;
+  if (processx__cloexec_fcntl(SERVER_FD, 1)) return 2;
+
+  // Signals from the terminal of R should not kill us
+  setsid();
+
+  // We are ready
+  if (send(SERVER_FD, &hello, sizeof(hello), MSG_NOSIGNAL) == -1) return 2;
+
+  for (;;) {
+    payload = NULL;
+    ret = recv_request(SERVER_FD, &payload, &len, fds, &nfds);
+    if (ret == 1) {
+      rd.ptr = payload;
+      rd.end = payload + len;
+      rd.error = 0;
+      reply = start_child(&rd, fds, nfds, stack);
+    }
+
+    for (i = 0; i < nfds; i++) close(fds[i]);
+    free(payload);
+
+    // EOF or a broken request, processx will not use us any more
+    if (ret != 1) break;
+
+    if (send(SERVER_FD, &reply, sizeof(reply), MSG_NOSIGNAL) == -1) break;
+  }
+
+  return 0;
+#endif
+}
@@ -7,11 +7,15 @@
 
 void R_init_processx_win(void);
 void R_init_processx_unix(void);
+void processx__lines_init(DllInfo *dll);
 SEXP processx__unload_cleanup(void);
 SEXP run_testthat_tests(void);
 SEXP processx__echo_on(void);
 SEXP processx__echo_off(void);
 SEXP processx__set_boot_time(SEXP);
+SEXP processx_forkserver_start(SEXP);
+SEXP processx_forkserver_stop(void);
+SEXP processx_forkserver_pid(void);
 
 #ifdef GCOV_COMPILE
 
@@ -32,10 +36,16 @@ SEXP gcov_flush(void) {
 
 static const R_CallMethodDef callMethods[]  = {
   CLEANCALL_METHOD_RECORD,
-  { "processx_exec",               (DL_FUNC) &processx_exec,              14 },
+  { "processx_exec",               (DL_FUNC) &processx_exec,              15 },
+  { "processx_exec_many",          (DL_FUNC) &processx_exec_many,          9 },
   { "processx_wait",               (DL_FUNC) &processx_wait,               3 },
+  { "processx_wait_many",          (DL_FUNC) &processx_wait_many,          3 },
+  { "processx_start_status",       (DL_FUNC) &processx_start_status,       2 },
   { "processx_is_alive",           (DL_FUNC) &processx_is_alive,           2 },
   { "processx_get_exit_status",    (DL_FUNC) &processx_get_exit_status,    2 },
+  { "processx_get_resource_usage", (DL_FUNC) &processx_get_resource_usage, 1 },
+  { "processx_get_timings",        (DL_FUNC) &processx_get_timings,        1 },
+  { "processx_start_drain",        (DL_FUNC) &processx_start_drain,        1 },
   { "processx_signal",             (DL_FUNC) &processx_signal,             3 },
   { "processx_interrupt",          (DL_FUNC) &processx_interrupt,          2 },
   { "processx_kill",               (DL_FUNC) &processx_kill,               3 },
@@ -50,10 +60,17 @@ static const R_CallMethodDef callMethods[]  = {
   { "processx_write_named_pipe",   (DL_FUNC) &processx_write_named_pipe,   2 },
   { "processx__proc_start_time",   (DL_FUNC) &processx__proc_start_time,   1 },
   { "processx__set_boot_time",     (DL_FUNC) &processx__set_boot_time,     1 },
+  { "processx_forkserver_start",   (DL_FUNC) &processx_forkserver_start,   1 },
+  { "processx_forkserver_stop",    (DL_FUNC) &processx_forkserver_stop,    0 },
+  { "processx_forkserver_pid",     (DL_FUNC) &processx_forkserver_pid,     0 },
 
   { "processx_connection_create",     (DL_FUNC) &processx_connection_create,     2 },
   { "processx_connection_read_chars", (DL_FUNC) &processx_connection_read_chars, 2 },
   { "processx_connection_read_lines", (DL_FUNC) &processx_connection_read_lines, 2 },
+  { "processx_connection_read_bytes", (DL_FUNC) &processx_connection_read_bytes, 2 },
+  { "processx_connection_read_all", (DL_FUNC) &processx_connection_read_all, 2 },
+  { "processx_connection_set_tail", (DL_FUNC) &processx_connection_set_tail, 3 },
+  { "processx_connection_read_tail", (DL_FUNC) &processx_connection_read_tail, 1 },
   { "processx_connection_write_bytes",(DL_FUNC) &processx_connection_write_bytes,2 },
   { "processx_connection_file_name",  (DL_FUNC) &processx_connection_file_name,  1 },
   { "processx_connection_is_eof",     (DL_FUNC) &processx_connection_is_eof,     1 },
@@ -89,6 +106,10 @@ static const R_CallMethodDef callMethods[]  = {
   { "processx_base64_decode", (DL_FUNC) &processx_base64_decode, 1 },
   { "processx__echo_on", (DL_FUNC) &processx__echo_on, 0 },
   { "processx__echo_off", (DL_FUNC) &processx__echo_off, 0 },
+  { "processx_run_new",    (DL_FUNC) &processx_run_new,    2 },
+  { "processx_run_read",   (DL_FUNC) &processx_run_read,   5 },
+  { "processx_run_output", (DL_FUNC) &processx_run_output, 2 },
+  { "processx_run_done",   (DL_FUNC) &processx_run_done,   1 },
 
   { "gcov_flush", (DL_FUNC) gcov_flush, 0 },
 
@@ -100,6 +121,7 @@ void R_init_processx(DllInfo *dll) {
   R_useDynamicSymbols(dll, FALSE);
   R_forceSymbols(dll, TRUE);
   cleancall_fns_dot_call = Rf_findVar(Rf_install(".Call"), R_BaseEnv);
+  processx__lines_init(dll);
 #ifdef _WIN32
   R_init_processx_win();
 #else
@@ -48,6 +48,18 @@ SEXP processx_poll(SEXP statuses, SEXP types, SEXP ms) {
       processx_c_pollable_from_curl(&pollables[j], status);
       j++;
       SET_VECTOR_ELT(result, i, allocVector(INTSXP, 1));
+
+    } else if (INTEGER(types)[i] == 4) {
+      processx_handle_t *handle = R_ExternalPtrAddr(status);
+      processx_c_pollable_from_start(&pollables[j], handle);
+      j++;
+      SET_VECTOR_ELT(result, i, allocVector(INTSXP, 1));
+
+    } else if (INTEGER(types)[i] == 5) {
+      processx_handle_t *handle = R_ExternalPtrAddr(status);
+      processx_c_pollable_from_exit(&pollables[j], handle);
+      j++;
+      SET_VECTOR_ELT(result, i, allocVector(INTSXP, 1));
     }
   }
 
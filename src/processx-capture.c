@@ -0,0 +1,120 @@
+#include "processx.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* Growable buffer to capture the output of a process.
+ *
+ * The data is kept in a single block of memory, that we grow by
+ * doubling it, so callers can read into it directly. If a spill size is
+ * set, and the buffer grows larger than that, then we move the data to
+ * a temporary file, and keep only the data that the caller still needs
+ * (e.g. the incomplete last line) in memory. At the end we create a
+ * single string from the file and the memory.
+ */
+
+#define PROCESSX__CAPTURE_MIN (64 * 1024)
+
+void processx__capture_init(processx_capture_t *cap, size_t spill,
+			    const char *filename) {
+  memset(cap, 0, sizeof(*cap));
+  cap->spill = spill;
+  if (filename) {
+    cap->filename = strdup(filename);
+    if (!cap->filename) {
+      R_THROW_ERROR("Cannot allocate memory for output capture");
+    }
+  }
+}
+
+/* Make sure that there is space for `need` more bytes, and return a
+   pointer to the free space. */
+
+char *processx__capture_reserve(processx_capture_t *cap, size_t need) {
+  size_t alloc = cap->alloc ? cap->alloc : PROCESSX__CAPTURE_MIN;
+  char *data;
+  if (cap->alloc - cap->size >= need) return cap->data + cap->size;
+  while (alloc - cap->size < need) alloc *= 2;
+  data = realloc(cap->data, alloc);
+  if (!data) R_THROW_ERROR("Cannot allocate memory for process output");
+  cap->data = data;
+  cap->alloc = alloc;
+  return cap->data + cap->size;
+}
+
+/* Move the first `upto` bytes to the file, if we are over the spill
+   size. The bytes from offset `upto` on stay in memory. Returns the
+   number of bytes that were moved. */
+
+size_t processx__capture_spill(processx_capture_t *cap, size_t upto) {
+  if (cap->spill == 0 || !cap->filename || cap->size <= cap->spill ||
+      upto == 0) {
+    return 0;
+  }
+
+  if (!cap->file) {
+    cap->file = fopen(cap->filename, "w+b");
+    if (!cap->file) {
+      R_THROW_POSIX_ERROR("Cannot open file `%s` for process output",
+			  cap->filename);
+    }
+  }
+
+  if (fwrite(cap->data, 1, upto, cap->file) != upto) {
+    R_THROW_POSIX_ERROR("Cannot write process output to `%s`",
+			cap->filename);
+  }
+  cap->spilled += upto;
+  memmove(cap->data, cap->data + upto, cap->size - upto);
+  cap->size -= upto;
+
+  return upto;
+}
+
+/* All captured data, as a string. We reuse the buffer to read back the
+   file, so we need to keep at most one copy of the output besides the
+   result. */
+
+SEXP processx__capture_string(processx_capture_t *cap) {
+  size_t total = cap->spilled + cap->size;
+  if (total > INT_MAX) {
+    R_THROW_ERROR("Process output is too long, %lu bytes, for an R string",
+		  (unsigned long) total);
+  }
+
+  if (cap->spilled > 0) {
+    processx__capture_reserve(cap, cap->spilled);
+    memmove(cap->data + cap->spilled, cap->data, cap->size);
+    rewind(cap->file);
+    if (fread(cap->data, 1, cap->spilled, cap->file) != cap->spilled) {
+      R_THROW_POSIX_ERROR("Cannot read process output from `%s`",
+			  cap->filename);
+    }
+    cap->size = total;
+    cap->spilled = 0;
+    fclose(cap->file);
+    cap->file = NULL;
+    remove(cap->filename);
+  }
+
+  return ScalarString(mkCharLenCE(cap->data ? cap->data : "",
+				  (int) total, CE_UTF8));
+}
+
+/* Free memory, close and remove the file. This can be called
+   multiple times. */
+
+void processx__capture_free(processx_capture_t *cap) {
+  if (cap->data) free(cap->data);
+  cap->data = NULL;
+  cap->size = cap->alloc = cap->spilled = 0;
+  if (cap->file) {
+    fclose(cap->file);
+    cap->file = NULL;
+    remove(cap->filename);
+  }
+  if (cap->filename) free(cap->filename);
+  cap->filename = NULL;
+}
@@ -3,17 +3,22 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <ctype.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdlib.h>
 
 #ifndef _WIN32
+#include <langinfo.h>
 #include <sys/uio.h>
 #include <poll.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/ioctl.h>
 #else
 #include <io.h>
 #endif
@@ -37,7 +42,8 @@ static void processx__connection_find_chars(processx_connection_t *ccon,
 static void processx__connection_find_lines(processx_connection_t *ccon,
 					    ssize_t maxlines,
 					    size_t *lines,
-					    int *eof);
+					    int *eof,
+					    size_t **ends);
 
 static void processx__connection_alloc(processx_connection_t *ccon);
 static void processx__connection_realloc(processx_connection_t *ccon);
@@ -47,13 +53,46 @@ static ssize_t processx__find_newline(processx_connection_t *ccon,
 static ssize_t processx__connection_read_until_newline(processx_connection_t
 						       *ccon);
 static void processx__connection_xfinalizer(SEXP con);
+#ifndef _WIN32
+static ssize_t processx__connection_read_fd(processx_connection_t *ccon,
+					    char *target, size_t nbyte);
+#endif
 static ssize_t processx__connection_to_utf8(processx_connection_t *ccon);
+static void processx__connection_consume_utf8(processx_connection_t *ccon,
+					      size_t bytes);
+static size_t processx__connection_take_bytes(processx_connection_t *ccon,
+					      char *target, size_t nbyte);
+static void processx__connection_tail_write(processx_connection_t *ccon,
+					    const char *data, size_t n);
+static void processx__connection_to_tail(processx_connection_t *ccon);
+static void processx__connection_tail_drain(processx_connection_t *ccon);
+static size_t processx__connection_bytes_available(processx_connection_t
+						   *ccon, ssize_t max);
+static void processx__connection_reserve(processx_connection_t *ccon,
+					 size_t need);
+static void processx__connection_read_all(processx_connection_t *ccon);
+static void processx__connection_compact(char *buffer, size_t *begin,
+					 size_t data_size,
+					 size_t allocated_size, size_t need);
+static int processx__connection_is_utf8_encoding(const char *encoding);
+static size_t processx__connection_utf8_tail(processx_connection_t *ccon);
+static ssize_t processx__connection_check_utf8(processx_connection_t *ccon);
 static void processx__connection_find_utf8_chars(processx_connection_t *ccon,
 						 ssize_t maxchars,
 						 ssize_t maxbytes,
 						 size_t *chars,
 						 size_t *bytes);
 
+/* With UTF-8 input on Unix we read right into the UTF-8 buffer. On
+   Windows the overlapped reads need a buffer that does not move, so
+   there we still read into the raw buffer, and copy. */
+
+#ifdef _WIN32
+#define PROCESSX__SHARED_BUFFER(ccon) 0
+#else
+#define PROCESSX__SHARED_BUFFER(ccon) ((ccon)->utf8_input)
+#endif
+
 #ifdef _WIN32
 #define PROCESSX_CHECK_VALID_CONN(x) do {				\
     if (!x) R_THROW_ERROR("Invalid connection object");                 \
@@ -159,10 +198,9 @@ SEXP processx_connection_read_chars(SEXP con, SEXP nchars) {
   processx__connection_find_chars(ccon, cnchars, -1, &utf8_chars,
 				  &utf8_bytes);
 
-  result = PROTECT(ScalarString(mkCharLenCE(ccon->utf8, (int) utf8_bytes,
-					    CE_UTF8)));
-  ccon->utf8_data_size -= utf8_bytes;
-  memmove(ccon->utf8, ccon->utf8 + utf8_bytes, ccon->utf8_data_size);
+  result = PROTECT(ScalarString(mkCharLenCE(ccon->utf8 + ccon->utf8_begin,
+					    (int) utf8_bytes, CE_UTF8)));
+  processx__connection_consume_utf8(ccon, utf8_bytes);
 
   UNPROTECT(1);
   return result;
@@ -173,41 +211,164 @@ SEXP processx_connection_read_lines(SEXP con, SEXP nlines) {
   processx_connection_t *ccon = R_ExternalPtrAddr(con);
   SEXP result;
   int cn = asInteger(nlines);
-  ssize_t newline, eol = -1;
-  size_t lines_read = 0, l;
+  size_t lines_read = 0, size;
+  size_t *ends;
   int eof = 0;
-  int slashr;
 
-  processx__connection_find_lines(ccon, cn, &lines_read, &eof);
+  processx__connection_find_lines(ccon, cn, &lines_read, &eof, &ends);
 
-  result = PROTECT(allocVector(STRSXP, lines_read + eof));
-  for (l = 0, newline = -1; l < lines_read; l++) {
-    eol = processx__find_newline(ccon, newline + 1);
-    slashr = eol > 0 && ccon->utf8[eol - 1] == '\r';
-    SET_STRING_ELT(
-      result, l,
-      mkCharLenCE(ccon->utf8 + newline + 1,
-		  (int) (eol - newline - 1 - slashr), CE_UTF8));
-    newline = eol;
+  if (eof) {
+    size = ccon->utf8_data_size;
+  } else if (lines_read > 0) {
+    size = ends[lines_read - 1] + 1;
+  } else {
+    size = 0;
   }
 
-  if (eof) {
-    eol = ccon->utf8_data_size - 1;
-    SET_STRING_ELT(
-      result, l,
-      mkCharLenCE(ccon->utf8 + newline + 1,
-		  (int) (eol - newline), CE_UTF8));
+  result = PROTECT(processx__lines_new(NULL, ccon->utf8 + ccon->utf8_begin,
+				       size, lines_read + eof, ends));
+  if (size > 0) processx__connection_consume_utf8(ccon, size);
+
+  UNPROTECT(1);
+  return result;
+}
+
+SEXP processx_connection_read_bytes(SEXP con, SEXP nbytes) {
+
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  SEXP result;
+  size_t size;
+  ssize_t bytes_read;
+
+  PROCESSX_CHECK_VALID_CONN(ccon);
+
+  /* Read right into the raw vector, so it needs the right size */
+  size = processx__connection_bytes_available(ccon, asInteger(nbytes));
+  PROTECT(result = allocVector(RAWSXP, size));
+  bytes_read = processx_c_connection_read_bytes(ccon, RAW(result), size);
+  if ((size_t) bytes_read < size) {
+    result = lengthgets(result, bytes_read);
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
+SEXP processx_connection_read_all(SEXP con, SEXP lines) {
+
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  int clines = LOGICAL(lines)[0];
+  SEXP result;
+  const char *data;
+  size_t size;
+
+  PROCESSX_CHECK_VALID_CONN(ccon);
+  processx__connection_read_all(ccon);
+
+  data = ccon->utf8 + ccon->utf8_begin;
+  size = ccon->utf8_data_size;
+
+  if (clines) {
+    /* The lines take over the buffer, and we start a new one, which
+       does not need to be big, because we won't read any more. */
+    char *block = ccon->utf8;
+    char *nb = malloc(64 * 1024);
+    if (!nb) R_THROW_ERROR("Cannot allocate memory for processx buffer");
+    ccon->utf8 = nb;
+    ccon->utf8_allocated_size = 64 * 1024;
+    ccon->utf8_begin = 0;
+    ccon->utf8_data_size = 0;
+    ccon->is_eof_ = 1;
+    return processx__lines_new(block, data, size,
+			       processx__lines_count(data, size), NULL);
+  }
+
+  if (size > INT_MAX) {
+    R_THROW_ERROR("Output is too long, %lu bytes, for an R string",
+		  (unsigned long) size);
   }
+  result = PROTECT(ScalarString(mkCharLenCE(data, (int) size, CE_UTF8)));
 
-  if (eol >= 0) {
-    ccon->utf8_data_size -= eol + 1;
-    memmove(ccon->utf8, ccon->utf8 + eol + 1, ccon->utf8_data_size);
+  processx__connection_consume_utf8(ccon, size);
+  ccon->is_eof_ = 1;
+
+  /* We won't read any more, so no need to keep a big buffer */
+  if (ccon->utf8_allocated_size > 64 * 1024) {
+    char *nb = realloc(ccon->utf8, 64 * 1024);
+    if (nb) {
+      ccon->utf8 = nb;
+      ccon->utf8_allocated_size = 64 * 1024;
+    }
   }
 
   UNPROTECT(1);
   return result;
 }
 
+SEXP processx_connection_set_tail(SEXP con, SEXP bytes, SEXP lines) {
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  double cbytes = REAL(bytes)[0];
+  int clines = INTEGER(lines)[0];
+
+  PROCESSX_CHECK_VALID_CONN(ccon);
+  if (ISNAN(cbytes) || cbytes < 1 || cbytes > INT_MAX) {
+    R_THROW_ERROR("Invalid tail size, must be between 1 and %d bytes",
+		  INT_MAX);
+  }
+  processx_c_connection_set_tail(ccon, (size_t) cbytes,
+				 clines == NA_INTEGER ? -1 : clines);
+#ifndef _WIN32
+  /* Keep reading in the background, even if R is busy */
+  if (!ccon->is_closed_) processx__drain_add(ccon, (size_t) cbytes);
+#endif
+  return R_NilValue;
+}
+
+/* The data in the ring buffer, without the partial UTF-8 character at
+   the beginning, if the buffer wrapped around. At most `tail_lines`
+   lines, if that is set. */
+
+SEXP processx_connection_read_tail(SEXP con) {
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  char *data;
+  size_t size, start = 0;
+
+  if (!ccon) R_THROW_ERROR("Invalid connection object");
+  if (!ccon->tail) {
+    R_THROW_ERROR("Connection is not in tail capture mode");
+  }
+
+  /* After the connection was closed, we can still return the tail */
+  if (!ccon->is_closed_) processx__connection_tail_drain(ccon);
+
+  size = ccon->tail_full ? ccon->tail_size : ccon->tail_end;
+  data = R_alloc(size + 1, 1);
+  if (ccon->tail_full) {
+    size_t first = ccon->tail_size - ccon->tail_end;
+    memcpy(data, ccon->tail + ccon->tail_end, first);
+    memcpy(data + first, ccon->tail, ccon->tail_end);
+    while (start < size && (data[start] & 0xc0) == 0x80) start++;
+  } else {
+    memcpy(data, ccon->tail, size);
+  }
+
+  if (ccon->tail_lines == 0) {
+    start = size;
+  } else if (ccon->tail_lines > 0) {
+    /* A newline at the very end does not start a new line */
+    size_t pos = size > start && data[size - 1] == '\n' ? size - 1 : size;
+    int nl = 0;
+    while (pos > start) {
+      if (data[pos - 1] == '\n' && ++nl >= ccon->tail_lines) break;
+      pos--;
+    }
+    start = pos;
+  }
+
+  return ScalarString(mkCharLenCE(data + start, (int) (size - start),
+				  CE_UTF8));
+}
+
 SEXP processx_connection_write_bytes(SEXP con, SEXP bytes) {
   processx_connection_t *ccon = R_ExternalPtrAddr(con);
   Rbyte *cbytes = RAW(bytes);
@@ -699,50 +860,48 @@ SEXP processx_connection_get_fileno(SEXP con) {
 SEXP processx_connection_disable_inheritance() {
   HANDLE handle;
   STARTUPINFOW si;
+  int count = 0;
 
   /* Make the windows stdio handles non-inheritable. */
   handle = GetStdHandle(STD_INPUT_HANDLE);
   if (handle != NULL && handle != INVALID_HANDLE_VALUE) {
-    SetHandleInformation(handle, HANDLE_FLAG_INHERIT, 0);
+    if (SetHandleInformation(handle, HANDLE_FLAG_INHERIT, 0)) count++;
   }
 
   handle = GetStdHandle(STD_OUTPUT_HANDLE);
   if (handle != NULL && handle != INVALID_HANDLE_VALUE) {
-    SetHandleInformation(handle, HANDLE_FLAG_INHERIT, 0);
+    if (SetHandleInformation(handle, HANDLE_FLAG_INHERIT, 0)) count++;
   }
 
   handle = GetStdHandle(STD_ERROR_HANDLE);
   if (handle != NULL && handle != INVALID_HANDLE_VALUE) {
-    SetHandleInformation(handle, HANDLE_FLAG_INHERIT, 0);
+    if (SetHandleInformation(handle, HANDLE_FLAG_INHERIT, 0)) count++;
   }
 
   /* Make inherited CRT FDs non-inheritable. */
   GetStartupInfoW(&si);
   if (processx__stdio_verify(si.lpReserved2, si.cbReserved2)) {
-    processx__stdio_noinherit(si.lpReserved2);
+    count += processx__stdio_noinherit(si.lpReserved2);
   }
 
-  return R_NilValue;
+  return ScalarInteger(count);
 }
 
 #else
 
 SEXP processx_connection_disable_inheritance(void) {
-  int fd;
+  int count;
 
-  /* Set the CLOEXEC flag on all open descriptors. Unconditionally try the
-   * first 16 file descriptors. After that, bail out after the first error.
+  /* Set the CLOEXEC flag on all open descriptors.
    * We skip the standard streams, because R and `system()` is not prepared
    * to not inheriting stdin and eg. an R subprocess does not even start in
    * system(). See https://github.com/r-lib/callr/issues/236. */
 
   int firstfd = 3;
   if (getenv("PROCESSX_CLOEXEC_STDIO")) firstfd = 0;
-  for (fd = firstfd; ; fd++) {
-    if (processx__cloexec_fcntl(fd, 1) && fd > 15) break;
-  }
+  count = processx__cloexec_all_fds(firstfd);
 
-  return R_NilValue;
+  return ScalarInteger(count < 0 ? NA_INTEGER : count);
 }
 
 #endif
@@ -768,15 +927,27 @@ processx_connection_t *processx_c_connection_create(
   con->is_eof_raw_ = 0;
   con->close_on_destroy = 1;
   con->iconv_ctx = 0;
+  con->utf8_input = processx__connection_is_utf8_encoding(encoding);
+  con->binary = 0;
 
   con->buffer = 0;
   con->buffer_allocated_size = 0;
+  con->buffer_begin = 0;
   con->buffer_data_size = 0;
 
   con->utf8 = 0;
   con->utf8_allocated_size = 0;
+  con->utf8_begin = 0;
   con->utf8_data_size = 0;
 
+  con->tail = 0;
+  con->tail_size = 0;
+  con->tail_end = 0;
+  con->tail_full = 0;
+  con->tail_lines = -1;
+
+  con->drain = 0;
+
   con->encoding = 0;
   if (encoding && encoding[0]) {
     con->encoding = strdup(encoding);
@@ -844,6 +1015,10 @@ void processx_c_connection_destroy(processx_connection_t *ccon) {
 
   if (ccon->buffer) { free(ccon->buffer); ccon->buffer = NULL; }
   if (ccon->utf8) { free(ccon->utf8); ccon->utf8 = NULL; }
+  if (ccon->tail) { free(ccon->tail); ccon->tail = NULL; }
+#ifndef _WIN32
+  processx__drain_remove(ccon);
+#endif
   if (ccon->encoding) { free(ccon->encoding); ccon->encoding = NULL; }
   if (ccon->filename) { free(ccon->filename); ccon->filename = NULL; }
 
@@ -870,13 +1045,91 @@ ssize_t processx_c_connection_read_chars(processx_connection_t *ccon,
 
   processx__connection_find_chars(ccon, -1, nbyte, &utf8_chars, &utf8_bytes);
 
-  memcpy(buffer, ccon->utf8, utf8_bytes);
-  ccon->utf8_data_size -= utf8_bytes;
-  memmove(ccon->utf8, ccon->utf8 + utf8_bytes, ccon->utf8_data_size);
+  memcpy(buffer, ccon->utf8 + ccon->utf8_begin, utf8_bytes);
+  processx__connection_consume_utf8(ccon, utf8_bytes);
 
   return utf8_bytes;
 }
 
+/* Read bytes, without any conversion. Data that was already converted
+   to UTF-8 is returned first. After this, we do not convert the data
+   while polling, until the next read of characters or lines. */
+ssize_t processx_c_connection_read_bytes(processx_connection_t *ccon,
+					 void *buffer,
+					 size_t nbyte) {
+  char *target = buffer;
+  size_t done;
+
+  PROCESSX_CHECK_VALID_CONN(ccon);
+  ccon->binary = 1;
+  done = processx__connection_take_bytes(ccon, target, nbyte);
+
+  if (done < nbyte && !ccon->is_eof_raw_) {
+#ifdef _WIN32
+    if (processx__connection_read(ccon) > 0) {
+      done += processx__connection_take_bytes(ccon, target + done,
+					      nbyte - done);
+    }
+#else
+    /* Straight from the file, without copying to our buffers */
+    ssize_t bytes_read =
+      processx__connection_read_fd(ccon, target + done, nbyte - done);
+    if (bytes_read == 0) {
+      ccon->is_eof_raw_ = 1;
+    } else if (bytes_read == -1 && errno == EAGAIN) {
+      /* Nothing to read now */
+    } else if (bytes_read == -1) {
+      R_THROW_SYSTEM_ERROR("Cannot read from processx connection");
+    } else {
+      done += bytes_read;
+    }
+#endif
+  }
+
+  if (ccon->is_eof_raw_ && ccon->utf8_data_size == 0 &&
+      ccon->buffer_data_size == 0) {
+    ccon->is_eof_ = 1;
+  }
+
+  return done;
+}
+
+/* Switch to tail capture mode. If we already have a tail, then we keep
+   as much of it as we can. */
+void processx_c_connection_set_tail(processx_connection_t *ccon,
+				    size_t bytes, int lines) {
+  char *tail = malloc(bytes);
+  size_t old_size, old_end;
+  int old_full;
+
+  if (!tail) R_THROW_ERROR("Cannot allocate memory for connection tail");
+
+  old_size = ccon->tail_size;
+  old_end = ccon->tail_end;
+  old_full = ccon->tail_full;
+  ccon->tail_size = bytes;
+  ccon->tail_end = 0;
+  ccon->tail_full = 0;
+  ccon->tail_lines = lines;
+
+  if (ccon->tail) {
+    char *old = ccon->tail;
+    ccon->tail = tail;
+    if (old_full) {
+      processx__connection_tail_write(ccon, old + old_end,
+				      old_size - old_end);
+    }
+    processx__connection_tail_write(ccon, old, old_end);
+    free(old);
+  } else {
+    ccon->tail = tail;
+  }
+
+  /* From now on everything goes to the tail, including what we have */
+  ccon->binary = 0;
+  processx__connection_to_tail(ccon);
+}
+
 /**
  * Read a single line, ending with \n
  *
@@ -899,6 +1152,7 @@ ssize_t processx_c_connection_read_line(processx_connection_t *ccon,
 
   int eof = 0;
   ssize_t newline;
+  const char *data;
 
   if (!linep) {
     R_THROW_ERROR("cannot read line, linep cannot be a null pointer");
@@ -908,6 +1162,7 @@ ssize_t processx_c_connection_read_line(processx_connection_t *ccon,
   }
 
   if (ccon->is_eof_) return -1;
+  ccon->binary = 0;
 
   /* Read until a newline character shows up, or there is nothing more
      to read (at least for now). */
@@ -915,9 +1170,10 @@ ssize_t processx_c_connection_read_line(processx_connection_t *ccon,
 
   /* If there is no newline at the end of the file, we still add the
      last line. */
+  data = ccon->utf8 + ccon->utf8_begin;
   if (ccon->is_eof_raw_ && ccon->utf8_data_size != 0 &&
       ccon->buffer_data_size == 0 &&
-      ccon->utf8[ccon->utf8_data_size - 1] != '\n') {
+      data[ccon->utf8_data_size - 1] != '\n') {
     eof = 1;
   }
 
@@ -926,7 +1182,7 @@ ssize_t processx_c_connection_read_line(processx_connection_t *ccon,
 
   /* Newline will contain the end of the line now, even if EOF */
   if (newline == -1) newline = ccon->utf8_data_size;
-  if (ccon->utf8[newline - 1] == '\r') newline--;
+  if (data[newline - 1] == '\r') newline--;
 
   if (! *linep) {
     *linep = malloc(newline + 1);
@@ -938,14 +1194,13 @@ ssize_t processx_c_connection_read_line(processx_connection_t *ccon,
     *linecapp = newline + 1;
   }
 
-  memcpy(*linep, ccon->utf8, newline);
+  memcpy(*linep, data, newline);
   (*linep)[newline] = '\0';
 
   if (!eof) {
-    ccon->utf8_data_size -= (newline + 1);
-    memmove(ccon->utf8, ccon->utf8 + newline + 1, ccon->utf8_data_size);
+    processx__connection_consume_utf8(ccon, newline + 1);
   } else {
-    ccon->utf8_data_size = 0;
+    processx__connection_consume_utf8(ccon, ccon->utf8_data_size);
   }
 
   return newline;
@@ -1013,6 +1268,7 @@ void processx_c_connection_close(processx_connection_t *ccon) {
   }
   ccon->handle.handle = 0;
 #else
+  processx__drain_remove(ccon);
   if (ccon->handle >= 0) close(ccon->handle);
   ccon->handle = -1;
 #endif
@@ -1101,6 +1357,7 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
       break;
 
     case PXCONNECT:
+    case PXEXIT:
       hasdata++;
       el->event = events[i];
       break;
@@ -1195,6 +1452,18 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
       }
     }
 
+    /* Process handles are not in the IOCP, we check them here */
+
+    for (i = 0; i < j; i++) {
+      processx_pollable_t *el = pollables + ptr[i];
+      if (el->pre_poll_func == processx_i_pre_poll_func_exit &&
+	  el->event == PXSILENT &&
+	  WaitForSingleObject(el->handle, 0) == WAIT_OBJECT_0) {
+	el->event = PXEXIT;
+	hasdata++;
+      }
+    }
+
     /* See if there was any data from the IOCP */
 
     if (overlapped) {
@@ -1203,7 +1472,9 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
       int poll_idx = con->poll_idx;
       con->handle.read_pending = FALSE;
       con->buffer_data_size += bytes;
-      if (con->buffer_data_size > 0) processx__connection_to_utf8(con);
+      if (con->buffer_data_size > 0 && !con->binary) {
+	processx__connection_to_utf8(con);
+      }
       if (con->type == PROCESSX_FILE_TYPE_ASYNCFILE) {
 	/* TODO: larger files */
 	con->handle.overlapped.Offset += bytes;
@@ -1253,6 +1524,8 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
 
 #else
 
+int processx_i_pre_poll_func_connection(processx_pollable_t *pollable);
+
 static int processx__poll_decode(short code) {
   if (code & POLLNVAL) return PXCLOSED;
   if (code & POLLIN || code & POLLHUP || code & POLLOUT) return PXREADY;
@@ -1312,6 +1585,7 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
       break;
 
     case PXREADY:
+    case PXEXIT:
       hasdata++;
       el->event = events[i];
       break;
@@ -1373,10 +1647,17 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
         pollables[ptr[i]].event = processx__poll_decode(fds[i].revents);
         if (pollables[ptr[i]].event == PXREADY) {
           hasdata ++;
-          processx_connection_t *ccon = pollables[ptr[i]].object;
-          if (ccon -> type == PROCESSX_FILE_TYPE_SOCKET &&
-              ccon -> state == PROCESSX_SOCKET_LISTEN) {
-            pollables[ptr[i]].event = PXCONNECT;
+          /* Not all PXHANDLE pollables are connections */
+          if (pollables[ptr[i]].pre_poll_func ==
+              processx_i_pre_poll_func_exit) {
+            pollables[ptr[i]].event = PXEXIT;
+          } else if (pollables[ptr[i]].pre_poll_func ==
+              processx_i_pre_poll_func_connection) {
+            processx_connection_t *ccon = pollables[ptr[i]].object;
+            if (ccon -> type == PROCESSX_FILE_TYPE_SOCKET &&
+                ccon -> state == PROCESSX_SOCKET_LISTEN) {
+              pollables[ptr[i]].event = PXCONNECT;
+            }
           }
         }
       }
@@ -1401,7 +1682,12 @@ void processx__connection_start_read(processx_connection_t *ccon) {
 
   if (!ccon->buffer) processx__connection_alloc(ccon);
 
-  todo = ccon->buffer_allocated_size - ccon->buffer_data_size;
+  /* No read is pending, so we can move the data */
+  processx__connection_compact(ccon->buffer, &ccon->buffer_begin,
+			       ccon->buffer_data_size,
+			       ccon->buffer_allocated_size, 1);
+  todo = ccon->buffer_allocated_size - ccon->buffer_begin -
+    ccon->buffer_data_size;
 
   if (ccon->type == PROCESSX_FILE_TYPE_SOCKET &&
       ccon->state == PROCESSX_SOCKET_LISTEN) {
@@ -1411,7 +1697,7 @@ void processx__connection_start_read(processx_connection_t *ccon) {
   } else {
     res = processx__thread_readfile(
       ccon,
-      ccon->buffer + ccon->buffer_data_size,
+      ccon->buffer + ccon->buffer_begin + ccon->buffer_data_size,
       todo,
       &bytes_read);
   }
@@ -1423,7 +1709,9 @@ void processx__connection_start_read(processx_connection_t *ccon) {
       if (ccon->utf8_data_size == 0 && ccon->buffer_data_size == 0) {
         ccon->is_eof_ = 1;
       }
-      if (ccon->buffer_data_size) processx__connection_to_utf8(ccon);
+      if (ccon->buffer_data_size && !ccon->binary) {
+	processx__connection_to_utf8(ccon);
+      }
     } else if (err == ERROR_IO_PENDING) {
       ccon->handle.read_pending = TRUE;
     } else if (err == ERROR_PIPE_LISTENING &&
@@ -1471,7 +1759,8 @@ void processx__connection_start_read(processx_connection_t *ccon) {
   if (ccon->is_closed_) return PXCLOSED;				\
   if (ccon->is_eof_) return PXREADY;					\
   if (ccon->utf8_data_size > 0) return PXREADY;				\
-  if (ccon->buffer_data_size > 0 && ccon->is_eof_raw_) return PXREADY;	\
+  if (ccon->buffer_data_size > 0 &&					\
+      (ccon->is_eof_raw_ || ccon->binary)) return PXREADY;		\
   if (ccon->buffer_data_size > 0) {					\
     processx__connection_to_utf8(ccon);					\
     if (ccon->utf8_data_size > 0) return PXREADY;			\
@@ -1481,6 +1770,11 @@ int processx_i_pre_poll_func_connection(processx_pollable_t *pollable) {
 
   processx_connection_t *ccon = pollable->object;
 
+  /* In tail mode we read whenever we can, instead of reporting data */
+  if (ccon && ccon->tail && !ccon->is_closed_) {
+    processx__connection_tail_drain(ccon);
+  }
+
   PROCESSX__I_PRE_POLL_FUNC_CONNECTION_READY;
 
 #ifdef _WIN32
@@ -1498,7 +1792,9 @@ int processx_i_pre_poll_func_connection(processx_pollable_t *pollable) {
     pollable->handle = ccon->handle.overlapped.hEvent;
   }
 #else
-  pollable->handle = ccon->handle;
+  /* If drained, the notification pipe is readable when there is data */
+  pollable->handle =
+    ccon->drain ? processx__drain_fd(ccon->drain) : ccon->handle;
 #endif
 
   return PXHANDLE;
@@ -1566,6 +1862,7 @@ static void processx__connection_find_chars(processx_connection_t *ccon,
   int should_read_more;
 
   PROCESSX_CHECK_VALID_CONN(ccon);
+  ccon->binary = 0;
 
   should_read_more = ! ccon->is_eof_ && ccon->utf8_data_size == 0;
   if (should_read_more) processx__connection_read(ccon);
@@ -1588,29 +1885,43 @@ static void processx__connection_find_chars(processx_connection_t *ccon,
  * @param lines Number of lines found is stored here.
  * @param eof If the end of the file is reached, and there is no `\n`
  *   at the end of the file, this is set to 1.
+ * @param ends The positions of the `\n` characters of the lines are
+ *   stored here, so the lines do not need to be searched again. This is
+ *   allocated with `R_alloc()`.
  *
  */
 
 static void processx__connection_find_lines(processx_connection_t *ccon,
 					    ssize_t maxlines,
 					    size_t *lines,
-					    int *eof ) {
+					    int *eof,
+					    size_t **ends) {
 
   ssize_t newline;
+  size_t size = 0;
 
   *eof = 0;
+  *ends = NULL;
 
   if (maxlines < 0) maxlines = 1000;
 
   PROCESSX_CHECK_VALID_CONN(ccon);
+  ccon->binary = 0;
 
   /* Read until a newline character shows up, or there is nothing more
      to read (at least for now). */
   newline = processx__connection_read_until_newline(ccon);
 
-  /* Count the number of lines we got. */
+  /* Count the number of lines we got, and record where they end */
   while (newline != -1 && *lines < maxlines) {
-    (*lines) ++;
+    if (*lines == size) {
+      size_t *old = *ends;
+      size = size ? 2 * size : 64;
+      if (size > maxlines) size = maxlines;
+      *ends = (size_t*) R_alloc(size, sizeof(size_t));
+      if (*lines) memcpy(*ends, old, *lines * sizeof(size_t));
+    }
+    (*ends)[(*lines)++] = newline;
     newline = processx__find_newline(ccon, /* start = */ newline + 1);
   }
 
@@ -1618,7 +1929,7 @@ static void processx__connection_find_lines(processx_connection_t *ccon,
      last line. */
   if (ccon->is_eof_raw_ && ccon->utf8_data_size != 0 &&
       ccon->buffer_data_size == 0 &&
-      ccon->utf8[ccon->utf8_data_size - 1] != '\n') {
+      ccon->utf8[ccon->utf8_begin + ccon->utf8_data_size - 1] != '\n') {
     *eof = 1;
   }
 
@@ -1629,37 +1940,44 @@ static void processx__connection_xfinalizer(SEXP con) {
   processx_c_connection_destroy(ccon);
 }
 
+/* Positions are relative to the beginning of the data in the UTF8
+   buffer. */
+
 static ssize_t processx__find_newline(processx_connection_t *ccon,
 				     size_t start) {
 
-  if (ccon->utf8_data_size == 0) return -1;
-  const char *ret = ccon->utf8 + start;
-  const char *end = ccon->utf8 + ccon->utf8_data_size;
-
-  while (ret < end && *ret != '\n') ret++;
+  if (start >= ccon->utf8_data_size) return -1;
+  const char *data = ccon->utf8 + ccon->utf8_begin;
+  const char *ret = memchr(data + start, '\n', ccon->utf8_data_size - start);
 
-  if (ret < end) return ret - ccon->utf8; else return -1;
+  if (ret) return ret - data; else return -1;
 }
 
 static ssize_t processx__connection_read_until_newline
   (processx_connection_t *ccon) {
 
-  char *ptr, *end;
+  size_t ptr, end;
+  const char *data;
 
   /* Make sure we try to have something, unless EOF */
   if (ccon->utf8_data_size == 0) processx__connection_read(ccon);
   if (ccon->utf8_data_size == 0) return -1;
 
-  /* We have sg in the utf8 at this point */
+  /* We have sg in the utf8 at this point. We use positions relative to
+     the beginning of the data, because the buffer might be compacted
+     or reallocated while reading. */
 
-  ptr = ccon->utf8;
-  end = ccon->utf8 + ccon->utf8_data_size;
+  ptr = 0;
+  end = ccon->utf8_data_size;
   while (1) {
     ssize_t new_bytes;
-    while (ptr < end && *ptr != '\n') ptr++;
+    const char *nl;
+    data = ccon->utf8 + ccon->utf8_begin;
+    nl = ptr < end ? memchr(data + ptr, '\n', end - ptr) : NULL;
 
     /* Have we found a newline? */
-    if (ptr < end) return ptr - ccon->utf8;
+    if (nl) return nl - data;
+    ptr = end;
 
     /* No newline, but EOF? */
     if (ccon->is_eof_) return -1;
@@ -1668,14 +1986,17 @@ static ssize_t processx__connection_read_until_newline
      * The 8 bytes is definitely more than what we need for a UTF8
      * character, and this makes sure that we don't stop just because
      * no more UTF8 characters fit in the UTF8 buffer. */
-    if (ccon->utf8_data_size >= ccon->utf8_allocated_size - 8) {
-      size_t ptrnum = ptr - ccon->utf8;
-      size_t endnum = end - ccon->utf8;
+    processx__connection_compact(ccon->utf8, &ccon->utf8_begin,
+				 ccon->utf8_data_size +
+				 processx__connection_utf8_tail(ccon),
+				 ccon->utf8_allocated_size, 8);
+    if (ccon->utf8_begin + ccon->utf8_data_size +
+	processx__connection_utf8_tail(ccon) >=
+	ccon->utf8_allocated_size - 8) {
       processx__connection_realloc(ccon);
-      ptr = ccon->utf8 + ptrnum;
-      end = ccon->utf8 + endnum;
     }
     new_bytes = processx__connection_read(ccon);
+    end = ccon->utf8_data_size;
 
     /* If we cannot read now, then we give up */
     if (new_bytes == 0) return -1;
@@ -1685,20 +2006,219 @@ static ssize_t processx__connection_read_until_newline
 /* Allocate buffer for reading */
 
 static void processx__connection_alloc(processx_connection_t *ccon) {
-  ccon->buffer = malloc(64 * 1024);
-  if (!ccon->buffer) R_THROW_ERROR("Cannot allocate memory for processx buffer");
-  ccon->buffer_allocated_size = 64 * 1024;
+  ccon->buffer_begin = 0;
   ccon->buffer_data_size = 0;
+  if (!PROCESSX__SHARED_BUFFER(ccon)) {
+    ccon->buffer = malloc(64 * 1024);
+    if (!ccon->buffer) {
+      R_THROW_ERROR("Cannot allocate memory for processx buffer");
+    }
+    ccon->buffer_allocated_size = 64 * 1024;
+  }
 
   ccon->utf8 = malloc(64 * 1024);
   if (!ccon->utf8) {
-    free(ccon->buffer);
+    if (ccon->buffer) free(ccon->buffer);
+    ccon->buffer = NULL;
     R_THROW_ERROR("Cannot allocate memory for processx buffer");
   }
   ccon->utf8_allocated_size = 64 * 1024;
+  ccon->utf8_begin = 0;
   ccon->utf8_data_size = 0;
 }
 
+/* Mark `bytes` bytes of the UTF8 buffer as read */
+
+static void processx__connection_consume_utf8(processx_connection_t *ccon,
+					      size_t bytes) {
+  ccon->utf8_begin += bytes;
+  ccon->utf8_data_size -= bytes;
+  /* Raw bytes after the data must stay where they are */
+  if (ccon->utf8_data_size == 0 &&
+      processx__connection_utf8_tail(ccon) == 0) {
+    ccon->utf8_begin = 0;
+  }
+}
+
+/* Append to the ring buffer of the tail, only the last `tail_size`
+   bytes are kept */
+
+static void processx__connection_tail_write(processx_connection_t *ccon,
+					    const char *data, size_t n) {
+  size_t first;
+  if (n >= ccon->tail_size) {
+    memcpy(ccon->tail, data + n - ccon->tail_size, ccon->tail_size);
+    ccon->tail_end = 0;
+    ccon->tail_full = 1;
+    return;
+  }
+  first = ccon->tail_size - ccon->tail_end;
+  if (first > n) first = n;
+  memcpy(ccon->tail + ccon->tail_end, data, first);
+  memcpy(ccon->tail, data + first, n - first);
+  if (ccon->tail_end + n >= ccon->tail_size) ccon->tail_full = 1;
+  ccon->tail_end = (ccon->tail_end + n) % ccon->tail_size;
+}
+
+/* In tail mode all UTF-8 data goes to the tail, as soon as we have it */
+
+static void processx__connection_to_tail(processx_connection_t *ccon) {
+  if (!ccon->tail || ccon->utf8_data_size == 0) return;
+  processx__connection_tail_write(ccon, ccon->utf8 + ccon->utf8_begin,
+				  ccon->utf8_data_size);
+  processx__connection_consume_utf8(ccon, ccon->utf8_data_size);
+}
+
+/* Read everything that is available now, without blocking, so the
+   other end does not block on a full pipe */
+
+static void processx__connection_tail_drain(processx_connection_t *ccon) {
+  while (processx__connection_read(ccon) > 0) ;
+}
+
+/* Copy at most `nbyte` bytes to `target`, from the UTF-8 data first,
+   and then from the raw data, and mark them as read. */
+
+static size_t processx__connection_take_bytes(processx_connection_t *ccon,
+					      char *target, size_t nbyte) {
+  size_t n, done = 0;
+
+  n = ccon->utf8_data_size < nbyte ? ccon->utf8_data_size : nbyte;
+  if (n > 0) {
+    memcpy(target, ccon->utf8 + ccon->utf8_begin, n);
+    processx__connection_consume_utf8(ccon, n);
+    done += n;
+  }
+
+  n = ccon->buffer_data_size < nbyte - done ?
+    ccon->buffer_data_size : nbyte - done;
+  if (n > 0) {
+    /* If we get here, then there is no UTF-8 data left, so with a
+       shared buffer the raw data starts at `utf8_begin`. */
+    if (PROCESSX__SHARED_BUFFER(ccon)) {
+      memcpy(target + done, ccon->utf8 + ccon->utf8_begin, n);
+      ccon->utf8_begin += n;
+      if (n == ccon->buffer_data_size) ccon->utf8_begin = 0;
+    } else {
+      memcpy(target + done, ccon->buffer + ccon->buffer_begin, n);
+      ccon->buffer_begin += n;
+#ifdef _WIN32
+      /* A pending read writes after the current data */
+      if (n == ccon->buffer_data_size && !ccon->handle.read_pending) {
+	ccon->buffer_begin = 0;
+      }
+#else
+      if (n == ccon->buffer_data_size) ccon->buffer_begin = 0;
+#endif
+    }
+    ccon->buffer_data_size -= n;
+    done += n;
+  }
+
+  return done;
+}
+
+/* Make sure that there is at least `need` bytes free space after the
+   UTF-8 data, and the raw data after it, if any. Grow the buffer to
+   double size, so reading a lot of data takes linear time. */
+
+static void processx__connection_reserve(processx_connection_t *ccon,
+					 size_t need) {
+  size_t used, new_size;
+  char *nb;
+
+  if (!ccon->utf8) processx__connection_alloc(ccon);
+  used = ccon->utf8_data_size + processx__connection_utf8_tail(ccon);
+  processx__connection_compact(ccon->utf8, &ccon->utf8_begin, used,
+			       ccon->utf8_allocated_size, need);
+  if (ccon->utf8_allocated_size - ccon->utf8_begin - used >= need) return;
+
+  new_size = ccon->utf8_allocated_size;
+  while (new_size - ccon->utf8_begin - used < need) new_size *= 2;
+  nb = realloc(ccon->utf8, new_size);
+  if (!nb) R_THROW_ERROR("Cannot allocate memory for processx buffer");
+  ccon->utf8 = nb;
+  ccon->utf8_allocated_size = new_size;
+}
+
+/* Read everything, until the end of the file. We keep all data in the
+   UTF-8 buffer, and wait on the connection if there is nothing to read.
+   If this is interrupted, then the data stays in the buffer. */
+
+static void processx__connection_read_all(processx_connection_t *ccon) {
+  processx_pollable_t pollable;
+
+  ccon->binary = 0;
+  processx_c_pollable_from_connection(&pollable, ccon);
+
+  while (1) {
+    ssize_t bytes_read;
+    processx__connection_reserve(ccon, 64 * 1024);
+    bytes_read = processx__connection_read(ccon);
+
+    if (ccon->is_eof_raw_) {
+      /* Converting the rest might need more than one call */
+      if (ccon->buffer_data_size == 0 || bytes_read == 0) break;
+
+    } else if (bytes_read == 0) {
+      /* The poll allocates with R_alloc, do not let that add up */
+      const void *vmax = vmaxget();
+      processx_c_connection_poll(&pollable, 1, -1);
+      vmaxset(vmax);
+    }
+  }
+
+  /* Anything left cannot be converted, and it must not stay after the
+     UTF-8 data, because the lines may take over the buffer. */
+  ccon->buffer_data_size = 0;
+}
+
+/* Number of bytes that we can probably read without blocking, but at
+   most `max`, if it is not negative. If we cannot tell, then we assume
+   64KB more than what is in the buffers. If the file has nothing, we
+   still want to try reading one byte, to see if it is at EOF. */
+
+static size_t processx__connection_bytes_available(processx_connection_t
+						   *ccon, ssize_t max) {
+  size_t size = ccon->utf8_data_size + ccon->buffer_data_size;
+  size_t more = 64 * 1024;
+
+#if !defined(_WIN32)
+  if (ccon->drain) {
+    more = processx__drain_size(ccon->drain);
+    if (more == 0) more = 1;
+  } else {
+#if defined(FIONREAD)
+    int navail;
+    if (ioctl(ccon->handle, FIONREAD, &navail) == 0) {
+      more = navail > 0 ? navail : 1;
+    }
+#endif
+  }
+#endif
+
+  if (!ccon->is_eof_raw_) size += more;
+  if (max >= 0 && size > (size_t) max) size = max;
+  return size;
+}
+
+/* Move the data to the front of a buffer, if there are less than `need`
+   bytes free at its end. We also do it if the free space is getting low,
+   and the data is not more than what was consumed before it, so copying
+   is amortized over the reads. */
+
+static void processx__connection_compact(char *buffer, size_t *begin,
+					 size_t data_size,
+					 size_t allocated_size, size_t need) {
+  size_t space = allocated_size - *begin - data_size;
+  if (*begin == 0) return;
+  if (space >= need && (space >= allocated_size / 4 || *begin < data_size)) {
+    return;
+  }
+  memmove(buffer, buffer + *begin, data_size);
+  *begin = 0;
+}
+
 /* We only really need to re-alloc the UTF8 buffer, because the
    other buffer is transient, even if there are no newline characters. */
 
@@ -1739,9 +2259,18 @@ ssize_t processx__connection_read(processx_connection_t *ccon) {
 
   if (!ccon->buffer) processx__connection_alloc(ccon);
 
-  /* If cannot read anything more, then try to convert to UTF8 */
-  todo = ccon->buffer_allocated_size - ccon->buffer_data_size;
-  if (todo == 0) return processx__connection_to_utf8(ccon);
+  /* If cannot read anything more, then try to convert to UTF8. We
+     cannot move the data while a read is pending. */
+  if (!ccon->handle.read_pending) {
+    processx__connection_compact(ccon->buffer, &ccon->buffer_begin,
+				 ccon->buffer_data_size,
+				 ccon->buffer_allocated_size, 1);
+  }
+  todo = ccon->buffer_allocated_size - ccon->buffer_begin -
+    ccon->buffer_data_size;
+  if (todo == 0) {
+    return ccon->binary ? 0 : processx__connection_to_utf8(ccon);
+  }
 
   /* Otherwise we read. If there is no read pending, we start one. */
   processx__connection_start_read(ccon);
@@ -1759,7 +2288,7 @@ ssize_t processx__connection_read(processx_connection_t *ccon) {
 	processx_connection_t *con = (processx_connection_t *) key;
 	con->handle.read_pending = FALSE;
 	con->buffer_data_size += bytes;
-	if (con->buffer && con->buffer_data_size > 0) {
+	if (con->buffer && con->buffer_data_size > 0 && !con->binary) {
 	  bytes = processx__connection_to_utf8(con);
 	}
 	if (con->type == PROCESSX_FILE_TYPE_ASYNCFILE) {
@@ -1794,8 +2323,17 @@ ssize_t processx__connection_read(processx_connection_t *ccon) {
 
 #else
 
+/* Like read(), from the background reader's buffer, if there is one */
+
+static ssize_t processx__connection_read_fd(processx_connection_t *ccon,
+					    char *target, size_t nbyte) {
+  if (ccon->drain) return processx__drain_take(ccon->drain, target, nbyte);
+  return read(ccon->handle, target, nbyte);
+}
+
 static ssize_t processx__connection_read(processx_connection_t *ccon) {
   ssize_t todo, bytes_read;
+  char *target;
 
   /* Nothing to read, nothing to convert to UTF8 */
   if (ccon->is_eof_raw_ && ccon->buffer_data_size == 0) {
@@ -1803,14 +2341,29 @@ static ssize_t processx__connection_read(processx_connection_t *ccon) {
     return 0;
   }
 
-  if (!ccon->buffer) processx__connection_alloc(ccon);
+  if (!ccon->utf8) processx__connection_alloc(ccon);
 
   /* If cannot read anything more, then try to convert to UTF8 */
-  todo = ccon->buffer_allocated_size - ccon->buffer_data_size;
+  if (ccon->utf8_input) {
+    processx__connection_compact(ccon->utf8, &ccon->utf8_begin,
+				 ccon->utf8_data_size + ccon->buffer_data_size,
+				 ccon->utf8_allocated_size, 1);
+    target = ccon->utf8 + ccon->utf8_begin + ccon->utf8_data_size;
+    todo = ccon->utf8_allocated_size - ccon->utf8_begin -
+      ccon->utf8_data_size - ccon->buffer_data_size;
+  } else {
+    processx__connection_compact(ccon->buffer, &ccon->buffer_begin,
+				 ccon->buffer_data_size,
+				 ccon->buffer_allocated_size, 1);
+    target = ccon->buffer + ccon->buffer_begin;
+    todo = ccon->buffer_allocated_size - ccon->buffer_begin -
+      ccon->buffer_data_size;
+  }
   if (todo == 0) return processx__connection_to_utf8(ccon);
 
   /* Otherwise we read */
-  bytes_read = read(ccon->handle, ccon->buffer + ccon->buffer_data_size, todo);
+  bytes_read = processx__connection_read_fd(
+    ccon, target + ccon->buffer_data_size, todo);
 
   if (bytes_read == 0) {
     /* EOF */
@@ -1846,14 +2399,25 @@ static ssize_t processx__connection_to_utf8(processx_connection_t *ccon) {
   const char *inbuf, *inbufold;
   char *outbuf, *outbufold;
   size_t inbytesleft = ccon->buffer_data_size;
-  size_t outbytesleft = ccon->utf8_allocated_size - ccon->utf8_data_size;
+  size_t outbytesleft;
   size_t r, indone = 0, outdone = 0;
   int moved = 0;
   const char *emptystr = "";
   const char *encoding = ccon->encoding ? ccon->encoding : emptystr;
 
-  inbuf = inbufold = ccon->buffer;
-  outbuf = outbufold = ccon->utf8 + ccon->utf8_data_size;
+  if (ccon->utf8_input) {
+    ssize_t checked = processx__connection_check_utf8(ccon);
+    processx__connection_to_tail(ccon);
+    return checked;
+  }
+
+  processx__connection_compact(ccon->utf8, &ccon->utf8_begin,
+			       ccon->utf8_data_size,
+			       ccon->utf8_allocated_size, 8);
+  outbytesleft = ccon->utf8_allocated_size - ccon->utf8_begin -
+    ccon->utf8_data_size;
+  inbuf = inbufold = ccon->buffer + ccon->buffer_begin;
+  outbuf = outbufold = ccon->utf8 + ccon->utf8_begin + ccon->utf8_data_size;
 
   /* If we this is the first time we are here. */
   if (! ccon->iconv_ctx) ccon->iconv_ctx = Riconv_open("UTF-8", encoding);
@@ -1894,11 +2458,183 @@ static ssize_t processx__connection_to_utf8(processx_connection_t *ccon) {
   indone = inbuf - inbufold;
   outdone = outbuf - outbufold;
   if (outdone > 0 || indone > 0) {
+    ccon->buffer_begin += indone;
     ccon->buffer_data_size -= indone;
-    memmove(ccon->buffer, ccon->buffer + indone, ccon->buffer_data_size);
+#ifdef _WIN32
+    /* A pending read writes after the current data */
+    if (ccon->buffer_data_size == 0 && !ccon->handle.read_pending) {
+      ccon->buffer_begin = 0;
+    }
+#else
+    if (ccon->buffer_data_size == 0) ccon->buffer_begin = 0;
+#endif
     ccon->utf8_data_size += outdone;
   }
 
+  processx__connection_to_tail(ccon);
+  return outdone;
+}
+
+/* Whether the input is already UTF-8. An empty encoding is the native
+   one. ASCII input still goes through iconv, which drops the bytes that
+   are not ASCII. */
+
+static int processx__connection_is_utf8_name(const char *name) {
+  const char *names[] = { "UTF-8", "UTF8", NULL };
+  int i;
+  for (i = 0; names[i]; i++) {
+    const char *p = name, *q = names[i];
+    while (*p && *q && toupper((unsigned char) *p) == *q) { p++; q++; }
+    if (!*p && !*q) return 1;
+  }
+  return 0;
+}
+
+static int processx__connection_is_utf8_encoding(const char *encoding) {
+  if (encoding && encoding[0]) {
+    return processx__connection_is_utf8_name(encoding);
+  }
+#ifdef _WIN32
+  return GetACP() == CP_UTF8;
+#else
+  const char *codeset = nl_langinfo(CODESET);
+  return codeset && processx__connection_is_utf8_name(codeset);
+#endif
+}
+
+/* Number of raw bytes after the UTF-8 data, in the UTF-8 buffer */
+
+static size_t processx__connection_utf8_tail(processx_connection_t *ccon) {
+  return PROCESSX__SHARED_BUFFER(ccon) ? ccon->buffer_data_size : 0;
+}
+
+/* Length of the longest prefix of `str` that is valid UTF-8, and ends at
+   a character boundary. If it stops at an invalid byte, then `*invalid`
+   is set to 1, otherwise it stopped at an incomplete character at the
+   end, or at the end. ASCII is checked eight bytes at a time. */
+
+static size_t processx__utf8_valid(const char *str, size_t len,
+				   int *invalid) {
+  const unsigned char *start = (const unsigned char *) str;
+  const unsigned char *ptr = start, *end = start + len;
+
+  *invalid = 0;
+  while (ptr < end) {
+    unsigned char c, lo = 0x80, hi = 0xbf;
+    size_t i, clen, avail;
+    uint64_t word;
+
+    while (end - ptr >= 8) {
+      memcpy(&word, ptr, 8);
+      if (word & UINT64_C(0x8080808080808080)) break;
+      ptr += 8;
+    }
+    if (ptr == end) break;
+
+    c = *ptr;
+    if (c < 0x80) { ptr++; continue; }
+
+    if (c >= 0xc2 && c <= 0xdf) {
+      clen = 2;
+    } else if (c >= 0xe0 && c <= 0xef) {
+      clen = 3;
+      if (c == 0xe0) lo = 0xa0;	/* overlong */
+      if (c == 0xed) hi = 0x9f;	/* surrogates */
+    } else if (c >= 0xf0 && c <= 0xf4) {
+      clen = 4;
+      if (c == 0xf0) lo = 0x90;	/* overlong */
+      if (c == 0xf4) hi = 0x8f;	/* above U+10FFFF */
+    } else {
+      *invalid = 1;
+      break;
+    }
+
+    avail = end - ptr;
+    if (avail > 1 && (ptr[1] < lo || ptr[1] > hi)) {
+      *invalid = 1;
+      break;
+    }
+    for (i = 2; i < clen && i < avail; i++) {
+      if ((ptr[i] & 0xc0) != 0x80) break;
+    }
+    if (i < clen && i < avail) {
+      *invalid = 1;
+      break;
+    }
+    if (avail < clen) break;
+    ptr += clen;
+  }
+
+  return ptr - start;
+}
+
+/* Instead of processx__connection_to_utf8() for UTF-8 input. We only
+   need to validate the input, and drop the invalid bytes, like iconv
+   does. With a shared buffer the valid data is already in place. */
+
+static ssize_t processx__connection_check_utf8(processx_connection_t *ccon) {
+  int shared = PROCESSX__SHARED_BUFFER(ccon);
+  size_t inleft = ccon->buffer_data_size;
+  size_t outleft, outdone = 0;
+  const char *in;
+  char *out;
+
+  if (inleft == 0) return 0;
+
+  if (shared) {
+    outleft = inleft;
+  } else {
+    processx__connection_compact(ccon->utf8, &ccon->utf8_begin,
+				 ccon->utf8_data_size,
+				 ccon->utf8_allocated_size, 8);
+    outleft = ccon->utf8_allocated_size - ccon->utf8_begin -
+      ccon->utf8_data_size;
+  }
+  out = ccon->utf8 + ccon->utf8_begin + ccon->utf8_data_size;
+  in = shared ? out : ccon->buffer + ccon->buffer_begin;
+
+  while (inleft > 0 && outleft > 0) {
+    size_t todo = inleft < outleft ? inleft : outleft;
+    int invalid;
+    size_t valid = processx__utf8_valid(in, todo, &invalid);
+    if (valid > 0 && out != in) memmove(out, in, valid);
+    in += valid;
+    inleft -= valid;
+    out += valid;
+    outleft -= valid;
+    outdone += valid;
+
+    if (invalid) {
+      in++;
+      inleft--;
+      if (shared) outleft--;
+
+    } else if (valid < todo) {
+      /* Does not end with a complete character. This is fine, we'll
+	 handle it later, unless we are at the end */
+      if (todo == inleft + valid && ccon->is_eof_raw_) {
+	warning("Invalid multi-byte character at end of stream ignored");
+	inleft = 0;
+      }
+      break;
+    }
+  }
+
+  if (shared) {
+    /* If we dropped some bytes, then the rest must follow the data */
+    if (inleft > 0 && in != out) memmove(out, in, inleft);
+  } else {
+    ccon->buffer_begin += ccon->buffer_data_size - inleft;
+#ifdef _WIN32
+    /* A pending read writes after the current data */
+    if (inleft == 0 && !ccon->handle.read_pending) ccon->buffer_begin = 0;
+#else
+    if (inleft == 0) ccon->buffer_begin = 0;
+#endif
+  }
+  ccon->buffer_data_size = inleft;
+  ccon->utf8_data_size += outdone;
+
   return outdone;
 }
 
@@ -1913,20 +2649,125 @@ static const unsigned char processx__utf8_length[] = {
   3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,
   4,4,4,4,4,4,4,4,5,5,5,5,6,6,6,6 };
 
+/* To count characters in bulk, we look at a block of bytes at once.
+ * processx__utf8_block() returns a bit mask of the continuation bytes
+ * in the block, bit `i` for byte `i`, and the mask of the bytes that
+ * _should_ be continuation bytes, according to the lead bytes. (This one
+ * can have bits after the block.) The return value is non-zero if the
+ * block has bytes that are never valid in UTF-8. With SSE2 a block is 16
+ * bytes, otherwise we use 8 byte words, on little endian platforms. */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define PROCESSX__UTF8_BLOCK 16
+
+static int processx__utf8_block(const char *ptr, unsigned int *cont,
+				unsigned int *expect) {
+  __m128i v = _mm_loadu_si128((const __m128i*) ptr);
+  unsigned int ge[6];
+  int i;
+  if (!_mm_movemask_epi8(v)) {
+    *cont = *expect = 0;
+    return 0;
+  }
+  for (i = 0; i < 6; i++) {
+    /* v >= 0xc0, 0xe0, 0xf0, 0xf8, 0xfc, 0xfe, as unsigned bytes */
+    __m128i lim = _mm_set1_epi8((char) (0xff << (6 - i)));
+    ge[i] = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, lim), v));
+  }
+  *cont = _mm_movemask_epi8(v) & ~ge[0];
+  *expect = (ge[0] << 1) | (ge[1] << 2) | (ge[2] << 3) | (ge[3] << 4) |
+    (ge[4] << 5);
+  return ge[5] != 0;
+}
+
+#elif !defined(WORDS_BIGENDIAN)
+#define PROCESSX__UTF8_BLOCK 8
+
+/* Collect the top bits of the bytes into one byte, byte `i` to bit `i` */
+#define PROCESSX__TOPBITS(x) ((unsigned int) \
+  ((((x) >> 7) * UINT64_C(0x0102040810204080)) >> 56))
+
+static int processx__utf8_block(const char *ptr, unsigned int *cont,
+				unsigned int *expect) {
+  const uint64_t msb = UINT64_C(0x8080808080808080);
+  uint64_t w, ge = msb;
+  unsigned int gemask[6];
+  int i;
+  memcpy(&w, ptr, 8);
+  if (!(w & msb)) {
+    *cont = *expect = 0;
+    return 0;
+  }
+  /* Byte is >= 0xc0, 0xe0, ... if the top i + 2 bits are set. Shifting
+     moves bits between bytes as well, but we only keep the top bits. */
+  for (i = 0; i < 6; i++) {
+    ge &= w << i;
+    gemask[i] = PROCESSX__TOPBITS(ge & (w << (i + 1)));
+  }
+  *cont = PROCESSX__TOPBITS(w & msb) & ~gemask[0];
+  *expect = (gemask[0] << 1) | (gemask[1] << 2) | (gemask[2] << 3) |
+    (gemask[3] << 4) | (gemask[4] << 5);
+  return gemask[5] != 0;
+}
+
+#endif
+
+#ifdef PROCESSX__UTF8_BLOCK
+
+static int processx__popcount(unsigned int x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcount(x);
+#else
+  int n = 0;
+  while (x) { x &= x - 1; n++; }
+  return n;
+#endif
+}
+
+#endif
+
 static void processx__connection_find_utf8_chars(processx_connection_t *ccon,
 						 ssize_t maxchars,
 						 ssize_t maxbytes,
 						 size_t *chars,
 						 size_t *bytes) {
 
-  char *ptr = ccon->utf8;
-  char *end = ccon->utf8 + ccon->utf8_data_size;
+  char *ptr = ccon->utf8 + ccon->utf8_begin;
+  char *end = ptr + ccon->utf8_data_size;
   size_t length = ccon->utf8_data_size;
   *chars = *bytes = 0;
 
   while (maxchars != 0 && maxbytes != 0 && ptr < end) {
     int clen, c = (unsigned char) *ptr;
 
+#ifdef PROCESSX__UTF8_BLOCK
+    if (length >= PROCESSX__UTF8_BLOCK) {
+      unsigned int cont, expect, check;
+      size_t blen = PROCESSX__UTF8_BLOCK, bchars;
+      int bad = processx__utf8_block(ptr, &cont, &expect);
+      /* If the last character continues after the block, then stop
+	 before it. We also check its lead byte below. */
+      if (expect >> PROCESSX__UTF8_BLOCK) {
+	while (blen > 0 && (cont & (1u << (blen - 1)))) blen--;
+	if (blen > 0) blen--;
+      }
+      check = blen < PROCESSX__UTF8_BLOCK ?
+	(1u << (blen + 1)) - 1 : (1u << blen) - 1;
+      bchars = blen - processx__popcount(cont & ((1u << blen) - 1));
+      /* Only if all continuation bytes are where they should be,
+	 otherwise we go byte by byte, and report the error, if any. */
+      if (!bad && blen > 0 && (cont & check) == (expect & check) &&
+	  (maxbytes < 0 || blen <= (size_t) maxbytes) &&
+	  (maxchars < 0 || bchars <= (size_t) maxchars)) {
+	(*chars) += bchars; (*bytes) += blen; ptr += blen; length -= blen;
+	if (maxchars > 0) maxchars -= bchars;
+	if (maxbytes > 0) maxbytes -= blen;
+	continue;
+      }
+    }
+#endif
+
     /* ASCII byte */
     if (c < 128) {
       (*chars) ++; (*bytes) ++; ptr++; length--;
@@ -62,6 +62,9 @@ typedef enum {
   PROCESSX_SOCKET_CONNECTED_CLIENT
 } processx_socket_state_t;
 
+/* Background reader, see unix/drain.c */
+typedef struct processx_drain_s processx_drain_t;
+
 typedef struct processx_connection_s {
   processx_file_type_t type;
 
@@ -72,17 +75,39 @@ typedef struct processx_connection_s {
 
   char *encoding;
   void *iconv_ctx;
+  int utf8_input;		/* UTF-8 input, no need for iconv */
+  int binary;			/* last read was binary, do not convert */
 
   processx_i_connection_t handle;
 
+  /* The data is at [begin, begin + data_size) in both buffers. Reading
+     moves `begin`, and the data is only moved to the front of the
+     buffer when there is not enough space at the end. With UTF-8 input
+     on Unix, `buffer` is not used, the raw data is read into `utf8`,
+     right after the UTF-8 data, and `buffer_data_size` is its size. */
   char* buffer;
   size_t buffer_allocated_size;
+  size_t buffer_begin;
   size_t buffer_data_size;
 
   char *utf8;
   size_t utf8_allocated_size;
+  size_t utf8_begin;
   size_t utf8_data_size;
 
+  /* Tail capture: all UTF-8 data goes into this ring buffer, and only
+     the last `tail_size` bytes are kept. `tail_end` is where the next
+     byte goes. */
+  char *tail;
+  size_t tail_size;
+  size_t tail_end;
+  int tail_full;		/* the ring buffer has wrapped around */
+  int tail_lines;		/* number of lines to return, or -1 */
+
+  /* If not NULL, a background thread reads `handle`, and we read from
+     its buffer instead. Unix only. */
+  processx_drain_t *drain;
+
   int poll_idx;
   char *filename;
   int state;
@@ -161,6 +186,16 @@ SEXP processx_connection_read_chars(SEXP con, SEXP nchars);
 /* Read lines of characters from the connection. */
 SEXP processx_connection_read_lines(SEXP con, SEXP nlines);
 
+/* Read everything until EOF, as a string or as lines. */
+SEXP processx_connection_read_all(SEXP con, SEXP lines);
+
+/* Read raw bytes from the connection, without any conversion. */
+SEXP processx_connection_read_bytes(SEXP con, SEXP nbytes);
+
+/* Keep only the last bytes or lines of the data, and read them */
+SEXP processx_connection_set_tail(SEXP con, SEXP bytes, SEXP lines);
+SEXP processx_connection_read_tail(SEXP con);
+
 /* Write characters */
 SEXP processx_connection_write_bytes(SEXP con, SEXP chars);
 
@@ -217,6 +252,19 @@ ssize_t processx_c_connection_read_line(
   char **linep,
   size_t *linecapp);
 
+/* Read bytes, without conversion */
+ssize_t processx_c_connection_read_bytes(
+  processx_connection_t *con,
+  void *buffer,
+  size_t nbyte);
+
+/* Keep only the last `bytes` bytes of the data, in a ring buffer.
+   `lines` is the number of lines to return, or -1 for all. */
+void processx_c_connection_set_tail(
+  processx_connection_t *ccon,
+  size_t bytes,
+  int lines);
+
 /* Write characters */
 ssize_t processx_c_connection_write_bytes(
   processx_connection_t *con,
@@ -0,0 +1,284 @@
+#include "processx.h"
+
+#include <Rversion.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* Character vectors of lines, read from a connection.
+ *
+ * Creating a CHARSXP for every line is expensive, because they all go
+ * into R's global CHARSXP cache. With R 3.6.0 and above we return an
+ * ALTREP character vector instead, for many lines. It keeps the UTF-8
+ * data in a single block, and the start and length of every line, and
+ * only creates the CHARSXP of a line when it is needed.
+ *
+ * The ALTREP object has
+ * - data1: a list of the block (an external pointer to memory from
+ *   malloc()) and the lines (a raw vector of processx__line_t).
+ *   Subsets of the vector share the block.
+ * - data2: the materialized character vector, or NULL. Once we have
+ *   it, we do not need data1 any more.
+ */
+
+/* Below this we just create a regular character vector */
+#define PROCESSX__LAZY_LINES 256
+
+typedef struct {
+  size_t start;
+  size_t length;
+} processx__line_t;
+
+/* Fill `lines` from the UTF-8 data. `ends` are the positions of the
+   newline characters, or NULL to find them here. If the data does not
+   end with a newline, then the last line ends at the end of the data,
+   and it has no entry in `ends`. A \r before the newline is not part
+   of the line. */
+
+static void processx__lines_find(const char *data, size_t size,
+				 size_t nlines, const size_t *ends,
+				 size_t offset, processx__line_t *lines) {
+  size_t l, start = 0;
+  for (l = 0; l < nlines; l++) {
+    const char *nl;
+    size_t end;
+    int slashr = 0;
+    if (l == nlines - 1 && (size == 0 || data[size - 1] != '\n')) {
+      nl = NULL;
+    } else if (ends) {
+      nl = data + ends[l];
+    } else {
+      nl = memchr(data + start, '\n', size - start);
+    }
+    end = nl ? (size_t) (nl - data) : size;
+    if (nl && end > start && data[end - 1] == '\r') slashr = 1;
+    if (end - slashr - start > INT_MAX) {
+      R_THROW_ERROR("Line is too long, %lu bytes, for an R string",
+		    (unsigned long) (end - slashr - start));
+    }
+    lines[l].start = offset + start;
+    lines[l].length = end - slashr - start;
+    start = end + 1;
+  }
+}
+
+size_t processx__lines_count(const char *data, size_t size) {
+  const char *ptr = data, *end = data + size, *nl;
+  size_t n = 0;
+  while (ptr < end && (nl = memchr(ptr, '\n', end - ptr))) {
+    n++;
+    ptr = nl + 1;
+  }
+  if (ptr < end) n++;
+  return n;
+}
+
+/* Memory from malloc(), freed by the GC, or earlier */
+
+static void processx__lines_block_finalizer(SEXP block) {
+  void *mem = R_ExternalPtrAddr(block);
+  if (mem) free(mem);
+  R_ClearExternalPtr(block);
+}
+
+static SEXP processx__lines_block(char *mem) {
+  SEXP block = PROTECT(R_MakeExternalPtr(NULL, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(block, processx__lines_block_finalizer, TRUE);
+  R_SetExternalPtrAddr(block, mem);
+  UNPROTECT(1);
+  return block;
+}
+
+static SEXP processx__lines_eager(const char *data, size_t size,
+				  size_t nlines, const size_t *ends) {
+  SEXP result = PROTECT(allocVector(STRSXP, nlines));
+  processx__line_t *lines =
+    (processx__line_t*) R_alloc(nlines, sizeof(processx__line_t));
+  size_t l;
+  processx__lines_find(data, size, nlines, ends, 0, lines);
+  for (l = 0; l < nlines; l++) {
+    SET_STRING_ELT(result, l, mkCharLenCE(data + lines[l].start,
+					  (int) lines[l].length, CE_UTF8));
+  }
+  UNPROTECT(1);
+  return result;
+}
+
+#if defined(R_VERSION) && R_VERSION >= R_Version(3, 6, 0)
+
+#include <R_ext/Altrep.h>
+
+static R_altrep_class_t processx__lines_class;
+
+static R_xlen_t processx__lines_length(SEXP x) {
+  SEXP mat = R_altrep_data2(x);
+  if (mat != R_NilValue) return XLENGTH(mat);
+  return XLENGTH(VECTOR_ELT(R_altrep_data1(x), 1)) /
+    sizeof(processx__line_t);
+}
+
+static SEXP processx__lines_mkchar(SEXP data1, R_xlen_t i) {
+  const char *mem = R_ExternalPtrAddr(VECTOR_ELT(data1, 0));
+  const processx__line_t *line =
+    (const processx__line_t*) RAW(VECTOR_ELT(data1, 1)) + i;
+  return mkCharLenCE(mem + line->start, (int) line->length, CE_UTF8);
+}
+
+static SEXP processx__lines_materialize(SEXP x) {
+  SEXP mat = R_altrep_data2(x);
+  SEXP data1;
+  R_xlen_t i, n;
+
+  if (mat != R_NilValue) return mat;
+
+  data1 = R_altrep_data1(x);
+  n = processx__lines_length(x);
+  mat = PROTECT(allocVector(STRSXP, n));
+  for (i = 0; i < n; i++) {
+    SET_STRING_ELT(mat, i, processx__lines_mkchar(data1, i));
+  }
+  R_set_altrep_data2(x, mat);
+  /* The block can go now, unless a subset still uses it */
+  R_set_altrep_data1(x, R_NilValue);
+
+  UNPROTECT(1);
+  return mat;
+}
+
+static Rboolean processx__lines_inspect(SEXP x, int pre, int deep,
+					int pvec,
+					void (*inspect_subtree)(SEXP, int,
+								int, int)) {
+  Rprintf("processx_lines (len=%ld, materialized=%s)\n",
+	  (long) processx__lines_length(x),
+	  R_altrep_data2(x) != R_NilValue ? "T" : "F");
+  return TRUE;
+}
+
+static SEXP processx__lines_elt(SEXP x, R_xlen_t i) {
+  SEXP mat = R_altrep_data2(x);
+  if (mat != R_NilValue) return STRING_ELT(mat, i);
+  return processx__lines_mkchar(R_altrep_data1(x), i);
+}
+
+static void processx__lines_set_elt(SEXP x, R_xlen_t i, SEXP v) {
+  SET_STRING_ELT(processx__lines_materialize(x), i, v);
+}
+
+static void *processx__lines_dataptr(SEXP x, Rboolean writeable) {
+  return (void*) STRING_PTR_RO(processx__lines_materialize(x));
+}
+
+static const void *processx__lines_dataptr_or_null(SEXP x) {
+  SEXP mat = R_altrep_data2(x);
+  if (mat == R_NilValue) return NULL;
+  return STRING_PTR_RO(mat);
+}
+
+/* A subset shares the block, and only needs a new list of lines. We
+   leave NAs and out of bounds indices to R. */
+
+static SEXP processx__lines_extract_subset(SEXP x, SEXP indx, SEXP call) {
+  SEXP data1, lines, result;
+  const processx__line_t *from;
+  processx__line_t *to;
+  R_xlen_t i, n, len;
+
+  if (R_altrep_data2(x) != R_NilValue) return NULL;
+  if (TYPEOF(indx) != INTSXP && TYPEOF(indx) != REALSXP) return NULL;
+  len = XLENGTH(indx);
+  if (len < PROCESSX__LAZY_LINES) return NULL;
+
+  n = processx__lines_length(x);
+  for (i = 0; i < len; i++) {
+    double idx = TYPEOF(indx) == INTSXP ?
+      (INTEGER(indx)[i] == NA_INTEGER ? -1 : INTEGER(indx)[i]) :
+      REAL(indx)[i];
+    if (ISNAN(idx) || idx < 1 || idx > n) return NULL;
+  }
+
+  data1 = R_altrep_data1(x);
+  lines = PROTECT(allocVector(RAWSXP, len * sizeof(processx__line_t)));
+  from = (const processx__line_t*) RAW(VECTOR_ELT(data1, 1));
+  to = (processx__line_t*) RAW(lines);
+  for (i = 0; i < len; i++) {
+    R_xlen_t idx = TYPEOF(indx) == INTSXP ? INTEGER(indx)[i] :
+      (R_xlen_t) REAL(indx)[i];
+    to[i] = from[idx - 1];
+  }
+
+  result = PROTECT(allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(result, 0, VECTOR_ELT(data1, 0));
+  SET_VECTOR_ELT(result, 1, lines);
+  result = R_new_altrep(processx__lines_class, result, R_NilValue);
+
+  UNPROTECT(2);
+  return result;
+}
+
+/* `block` is memory from malloc() that holds `data`, or NULL. If it is
+   not NULL, then we take it over, and free it when we do not need it. */
+
+SEXP processx__lines_new(char *block, const char *data, size_t size,
+			 size_t nlines, const size_t *ends) {
+  SEXP xblock = PROTECT(processx__lines_block(block));
+  SEXP lines, data1, result;
+
+  if (nlines < PROCESSX__LAZY_LINES) {
+    result = processx__lines_eager(data, size, nlines, ends);
+    processx__lines_block_finalizer(xblock);
+    UNPROTECT(1);
+    return result;
+  }
+
+  if (!block) {
+    block = malloc(size > 0 ? size : 1);
+    if (!block) R_THROW_ERROR("Cannot allocate memory for lines");
+    R_SetExternalPtrAddr(xblock, block);
+    memcpy(block, data, size);
+    data = block;
+  }
+
+  lines = PROTECT(allocVector(RAWSXP, nlines * sizeof(processx__line_t)));
+  processx__lines_find(data, size, nlines, ends, data - block,
+		       (processx__line_t*) RAW(lines));
+
+  data1 = PROTECT(allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(data1, 0, xblock);
+  SET_VECTOR_ELT(data1, 1, lines);
+  result = R_new_altrep(processx__lines_class, data1, R_NilValue);
+
+  UNPROTECT(3);
+  return result;
+}
+
+void processx__lines_init(DllInfo *dll) {
+  R_altrep_class_t cls =
+    R_make_altstring_class("processx_lines", "processx", dll);
+  processx__lines_class = cls;
+
+  R_set_altrep_Length_method(cls, processx__lines_length);
+  R_set_altrep_Inspect_method(cls, processx__lines_inspect);
+  R_set_altvec_Dataptr_method(cls, processx__lines_dataptr);
+  R_set_altvec_Dataptr_or_null_method(cls, processx__lines_dataptr_or_null);
+  R_set_altvec_Extract_subset_method(cls, processx__lines_extract_subset);
+  R_set_altstring_Elt_method(cls, processx__lines_elt);
+  R_set_altstring_Set_elt_method(cls, processx__lines_set_elt);
+}
+
+#else
+
+SEXP processx__lines_new(char *block, const char *data, size_t size,
+			 size_t nlines, const size_t *ends) {
+  SEXP xblock = PROTECT(processx__lines_block(block));
+  SEXP result = processx__lines_eager(data, size, nlines, ends);
+  processx__lines_block_finalizer(xblock);
+  UNPROTECT(1);
+  return result;
+}
+
+void processx__lines_init(DllInfo *dll) {
+  /* No ALTREP before R 3.6.0 */
+}
+
+#endif
@@ -0,0 +1,157 @@
+#include "processx.h"
+
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* Output capture and line splitting for run().
+ *
+ * We keep all standard output and error of the process in capture
+ * buffers, as it is read from the connections. The data is copied from
+ * the connection's UTF-8 buffer directly, we do not create an R string
+ * for every chunk. The incomplete last line (the pushback) is simply
+ * the end of the captured data, so if there is a line callback, we only
+ * need to remember where it starts. This part of the data stays in
+ * memory, even if the rest is spilled to a file.
+ */
+
+typedef struct {
+  processx_capture_t capture;
+  size_t line_begin;		/* start of the incomplete line */
+} processx__run_stream_t;
+
+typedef struct {
+  processx__run_stream_t streams[2];
+} processx__run_t;
+
+/* How much we can read from a connection at once, at least */
+#define PROCESSX__RUN_READ (64 * 1024)
+
+static void processx__run_free(processx__run_t *crun) {
+  int i;
+  for (i = 0; i < 2; i++) processx__capture_free(&crun->streams[i].capture);
+}
+
+static void processx__run_finalizer(SEXP run) {
+  processx__run_t *crun = R_ExternalPtrAddr(run);
+  if (!crun) return;
+  processx__run_free(crun);
+  free(crun);
+  R_ClearExternalPtr(run);
+}
+
+static processx__run_stream_t *processx__run_stream(SEXP run, SEXP which) {
+  processx__run_t *crun = R_ExternalPtrAddr(run);
+  int cwhich = INTEGER(which)[0];
+  if (!crun) R_THROW_ERROR("Invalid run() output buffer");
+  if (cwhich != 1 && cwhich != 2) {
+    R_THROW_ERROR("Invalid output stream: %d", cwhich);
+  }
+  return &crun->streams[cwhich - 1];
+}
+
+/* `spill` is the spill size in bytes, or NA or Inf to keep all output
+   in memory. `files` are the names of the files to spill to, for
+   standard output and error. */
+
+SEXP processx_run_new(SEXP spill, SEXP files) {
+  processx__run_t *crun = calloc(1, sizeof(processx__run_t));
+  double cspill = REAL(spill)[0];
+  size_t sspill = ISNAN(cspill) || !R_FINITE(cspill) || cspill < 1 ?
+    0 : (size_t) cspill;
+  SEXP result;
+  int i;
+
+  if (!crun) R_THROW_ERROR("Cannot allocate memory for run() output");
+  result = PROTECT(R_MakeExternalPtr(crun, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(result, processx__run_finalizer, TRUE);
+  for (i = 0; i < 2; i++) {
+    processx__capture_init(
+      &crun->streams[i].capture, sspill,
+      i < LENGTH(files) ? CHAR(STRING_ELT(files, i)) : NULL);
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* Read whatever is available from the connection, and append it to the
+   captured output. If there is no data available, then we try to read
+   from the connection once, without blocking.
+
+   Returns NULL if there was no new data, or a list of two elements:
+   1. the new data, as a string, if `chunk` is TRUE, or NULL,
+   2. the new complete lines, if `lines` is TRUE, or NULL. The lines are
+      split at \n or \r\n, the pushback is kept for the next call. */
+
+SEXP processx_run_read(SEXP run, SEXP con, SEXP which, SEXP chunk,
+		       SEXP lines) {
+  processx__run_stream_t *stream = processx__run_stream(run, which);
+  processx_capture_t *cap = &stream->capture;
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  size_t start = cap->size;
+  ssize_t nread;
+  SEXP result;
+
+  if (!ccon) R_THROW_ERROR("Invalid connection object");
+
+  do {
+    char *ptr = processx__capture_reserve(cap, PROCESSX__RUN_READ);
+    nread = processx_c_connection_read_chars(ccon, ptr,
+					     cap->alloc - cap->size);
+    cap->size += nread;
+  } while (nread > 0 && ccon->utf8_data_size > 0);
+
+  if (cap->size == start) return R_NilValue;
+
+  result = PROTECT(allocVector(VECSXP, 2));
+
+  if (LOGICAL(chunk)[0]) {
+    if (cap->size - start > INT_MAX) {
+      R_THROW_ERROR("Process output is too long, %lu bytes, for an R string",
+		    (unsigned long) (cap->size - start));
+    }
+    SET_VECTOR_ELT(result, 0, ScalarString(mkCharLenCE(
+      cap->data + start, (int) (cap->size - start), CE_UTF8)));
+  }
+
+  if (LOGICAL(lines)[0]) {
+    /* Only the new data can have new newlines */
+    const char *begin = cap->data + stream->line_begin;
+    const char *ptr = cap->data + cap->size, *nl = NULL;
+    while (ptr > cap->data + start) {
+      if (*--ptr == '\n') { nl = ptr; break; }
+    }
+    if (nl) {
+      size_t size = nl + 1 - begin;
+      SET_VECTOR_ELT(result, 1, processx__lines_new(
+        NULL, begin, size, processx__lines_count(begin, size), NULL));
+      stream->line_begin += size;
+    } else {
+      SET_VECTOR_ELT(result, 1, allocVector(STRSXP, 0));
+    }
+  } else {
+    stream->line_begin = cap->size;
+  }
+
+  stream->line_begin -= processx__capture_spill(cap, stream->line_begin);
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* All captured output, as a string */
+
+SEXP processx_run_output(SEXP run, SEXP which) {
+  processx__run_stream_t *stream = processx__run_stream(run, which);
+  return processx__capture_string(&stream->capture);
+}
+
+/* Free the buffers and remove the spill files, without waiting for
+   the GC */
+
+SEXP processx_run_done(SEXP run) {
+  processx__run_t *crun = R_ExternalPtrAddr(run);
+  if (crun) processx__run_free(crun);
+  return R_NilValue;
+}
@@ -18,6 +18,8 @@ extern "C" {
 #include "processx-connection.h"
 #include "errors.h"
 
+#include <stdio.h>
+
 #ifdef _WIN32
 #include <windows.h>
 #else
@@ -46,10 +48,18 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP pty, SEXP pty_options,
 		   SEXP connections, SEXP env, SEXP windows_verbatim_args,
 		   SEXP windows_hide_window, SEXP windows_detached_process,
 		   SEXP private_, SEXP cleanup, SEXP wd, SEXP encoding,
-		   SEXP tree_id);
+		   SEXP tree_id, SEXP async);
+SEXP processx_exec_many(SEXP commands, SEXP args, SEXP connections,
+			SEXP env, SEXP privates, SEXP cleanup, SEXP wd,
+			SEXP encoding, SEXP tree_ids);
 SEXP processx_wait(SEXP status, SEXP timeout, SEXP name);
+SEXP processx_wait_many(SEXP statuses, SEXP all, SEXP timeout);
+SEXP processx_start_status(SEXP status, SEXP name);
 SEXP processx_is_alive(SEXP status, SEXP name);
 SEXP processx_get_exit_status(SEXP status, SEXP name);
+SEXP processx_get_resource_usage(SEXP status);
+SEXP processx_get_timings(SEXP status);
+SEXP processx_start_drain(SEXP status);
 SEXP processx_signal(SEXP status, SEXP signal, SEXP name);
 SEXP processx_interrupt(SEXP status, SEXP name);
 SEXP processx_kill(SEXP status, SEXP grace, SEXP name);
@@ -72,6 +82,12 @@ SEXP processx_disable_crash_dialog(void);
 SEXP processx_base64_encode(SEXP array);
 SEXP processx_base64_decode(SEXP array);
 
+SEXP processx_run_new(SEXP spill, SEXP files);
+SEXP processx_run_read(SEXP run, SEXP con, SEXP which, SEXP chunk,
+		       SEXP lines);
+SEXP processx_run_output(SEXP run, SEXP which);
+SEXP processx_run_done(SEXP run);
+
 /* Common declarations */
 
 /* Interruption interval in ms */
@@ -98,11 +114,12 @@ SEXP processx_base64_decode(SEXP array);
                                 /* but there were events on other fds */
 #define PXEVENT   6             /* some event, this is used for curl fds */
 #define PXCONNECT 7             /* a connection is available for a server socket */
+#define PXEXIT    8             /* the process has exited */
 
 /* These statuses can be only returned by the pre-poll functions */
 
-#define PXHANDLE  8             /* need to poll the set handle */
-#define PXSELECT  9             /* need to poll/select the set fd */
+#define PXHANDLE  9             /* need to poll the set handle */
+#define PXSELECT  10            /* need to poll/select the set fd */
 
 typedef struct {
   int windows_verbatim_args;
@@ -113,6 +130,38 @@ typedef struct {
   int pty_cols;
 } processx_options_t;
 
+/* Character vectors of lines, see processx-lines.c */
+SEXP processx__lines_new(char *block, const char *data, size_t size,
+			 size_t nlines, const size_t *ends);
+size_t processx__lines_count(const char *data, size_t size);
+
+/* Buffer to capture process output, see processx-capture.c */
+typedef struct {
+  char *data;			/* the data that is in memory */
+  size_t size;
+  size_t alloc;
+  size_t spill;			/* spill to the file above this, or 0 */
+  char *filename;
+  FILE *file;
+  size_t spilled;		/* number of bytes in the file */
+} processx_capture_t;
+
+void processx__capture_init(processx_capture_t *cap, size_t spill,
+			    const char *filename);
+char *processx__capture_reserve(processx_capture_t *cap, size_t need);
+size_t processx__capture_spill(processx_capture_t *cap, size_t upto);
+SEXP processx__capture_string(processx_capture_t *cap);
+void processx__capture_free(processx_capture_t *cap);
+
+/* Pollable for the start of an asynchronously started process */
+int processx_c_pollable_from_start(processx_pollable_t *pollable,
+				   processx_handle_t *handle);
+
+/* Pollable for the exit of a process */
+int processx_c_pollable_from_exit(processx_pollable_t *pollable,
+				  processx_handle_t *handle);
+int processx_i_pre_poll_func_exit(processx_pollable_t *pollable);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,457 @@
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <limits.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/syscall.h>
+#endif
+
+#include "child.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+int processx__nonblock_fcntl(int fd, int set) {
+  int flags;
+  int r;
+
+  do { r = fcntl(fd, F_GETFL); } while (r == -1 && errno == EINTR);
+  if (r == -1) { return -errno; }
+
+  /* Bail out now if already set/clear. */
+  if (!!(r & O_NONBLOCK) == !!set) { return 0; }
+
+  if (set) { flags = r | O_NONBLOCK; } else { flags = r & ~O_NONBLOCK; }
+
+  do { r = fcntl(fd, F_SETFL, flags); } while (r == -1 && errno == EINTR);
+  if (r) { return -errno; }
+
+  return 0;
+}
+
+int processx__cloexec_fcntl(int fd, int set) {
+  int flags;
+  int r;
+
+  do { r = fcntl(fd, F_GETFD); } while (r == -1 && errno == EINTR);
+  if (r == -1) { return -errno; }
+
+  /* Bail out now if already set/clear. */
+  if (!!(r & FD_CLOEXEC) == !!set) { return 0; }
+
+  if (set) { flags = r | FD_CLOEXEC; } else { flags = r & ~FD_CLOEXEC; }
+
+  do { r = fcntl(fd, F_SETFD, flags); } while (r == -1 && errno == EINTR);
+  if (r) { return -errno; }
+
+  return 0;
+}
+
+const char *processx__child_path(char **env) {
+  for (; *env; env++) {
+    if (!strncmp(*env, "PATH=", 5)) return *env + 5;
+  }
+  return NULL;
+}
+
+/* These run in the child process, so no coverage here. */
+/* LCOV_EXCL_START */
+
+void processx__write_int(int fd, int err) {
+  ssize_t dummy = write(fd, &err, sizeof(int));
+  (void) dummy;
+}
+
+/* Report errno to the parent and quit. We cannot throw an R error
+   here, the child might share its memory with the parent. */
+
+static void processx__child_fail(int error_fd) {
+  processx__write_int(error_fd, -errno);
+  _exit(127);
+}
+
+/* Signal handlers installed by R (or by other packages) must not run in
+   the child, before the exec. With CLONE_VM they would run on the memory
+   of the parent. So we reset them to the default, and only then restore
+   the signal mask of the parent, with SIGCHLD unblocked. */
+
+static void processx__child_reset_signals(const sigset_t *mask) {
+  struct sigaction act;
+  int sig;
+
+  for (sig = 1; sig < NSIG; sig++) {
+    if (sigaction(sig, NULL, &act) == -1) continue;
+    if (!(act.sa_flags & SA_SIGINFO) &&
+        (act.sa_handler == SIG_IGN || act.sa_handler == SIG_DFL)) {
+      continue;
+    }
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = SIG_DFL;
+    sigemptyset(&act.sa_mask);
+    sigaction(sig, &act, NULL);
+  }
+
+  sigprocmask(SIG_SETMASK, mask, NULL);
+}
+
+static void processx__child_execve(const char *path,
+                                   processx__child_args_t *child) {
+  execve(path, child->args, child->env);
+  if (errno == ENOEXEC) {
+    /* Not an executable format, run it with the shell, like execvp */
+    child->sh_args[1] = (char*) path;
+    execve("/bin/sh", child->sh_args, child->env);
+    errno = ENOEXEC;
+  }
+}
+
+/* execvp() might allocate memory and it uses the environment of the
+   parent, so we do the PATH search ourselves. */
+
+static void processx__child_execvpe(processx__child_args_t *child) {
+  const char *file = child->command;
+  const char *p, *z;
+  char buf[PATH_MAX];
+  size_t flen, dlen;
+  int seen_eacces = 0;
+
+  if (file[0] == '\0') {
+    errno = ENOENT;
+    return;
+  }
+
+  if (strchr(file, '/')) {
+    processx__child_execve(file, child);
+    return;
+  }
+
+  flen = strlen(file);
+  p = child->path ? child->path : "/bin:/usr/bin";
+
+  for (;;) {
+    z = strchr(p, ':');
+    dlen = z ? (size_t) (z - p) : strlen(p);
+
+    if (dlen + flen + 2 <= sizeof(buf)) {
+      if (dlen == 0) {
+        /* Empty PATH element is the current directory */
+        memcpy(buf, file, flen + 1);
+      } else {
+        memcpy(buf, p, dlen);
+        buf[dlen] = '/';
+        memcpy(buf + dlen + 1, file, flen + 1);
+      }
+      processx__child_execve(buf, child);
+
+      switch (errno) {
+      case EACCES:
+        seen_eacces = 1;
+        /* fallthrough */
+      case ENOENT:
+      case ENOTDIR:
+      case ENAMETOOLONG:
+#ifdef ESTALE
+      case ESTALE:
+#endif
+#ifdef ENODEV
+      case ENODEV:
+#endif
+#ifdef ETIMEDOUT
+      case ETIMEDOUT:
+#endif
+        break;
+      default:
+        return;
+      }
+    }
+
+    if (!z) break;
+    p = z + 1;
+  }
+
+  errno = seen_eacces ? EACCES : ENOENT;
+}
+
+/* Upper limit for closing fds one by one, if there is no better way.
+   This runs in the parent. It is capped at 65536, because with a very
+   high or unlimited RLIMIT_NOFILE the loop would take too long. */
+
+int processx__child_max_fd(void) {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == -1 ||
+      rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > 65536) {
+    return 65536;
+  }
+  return rl.rlim_cur < 256 ? 256 : (int) rl.rlim_cur;
+}
+
+static int processx__close_range(unsigned int first, unsigned int last) {
+#if defined(PROCESSX__NR_CLOSE_RANGE)
+  return syscall(PROCESSX__NR_CLOSE_RANGE, first, last, 0);
+#elif defined(__FreeBSD__) || defined(__OpenBSD__) || \
+      defined(__NetBSD__) || defined(__sun)
+  if (last == ~0U) {
+    closefrom(first);
+    return 0;
+  }
+  errno = ENOSYS;
+  return -1;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+#ifdef __linux__
+
+/* Older kernels do not have close_range(), so we list /proc/self/fd.
+   We cannot use opendir() here, because it allocates memory. */
+
+struct processx__dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+static int processx__child_close_procfs(int from) {
+  union {
+    struct processx__dirent64 align;
+    char buf[4096];
+  } dirbuf;
+  struct processx__dirent64 *ent;
+  long n, off;
+  int dirfd, fd;
+  const char *c;
+
+  dirfd = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirfd == -1) return -1;
+
+  for (;;) {
+    n = syscall(SYS_getdents64, dirfd, dirbuf.buf, sizeof(dirbuf.buf));
+    if (n == -1) {
+      close(dirfd);
+      return -1;
+    }
+    if (n == 0) break;
+    for (off = 0; off < n; off += ent->d_reclen) {
+      ent = (struct processx__dirent64*) (dirbuf.buf + off);
+      if (ent->d_name[0] < '0' || ent->d_name[0] > '9') continue;
+      for (fd = 0, c = ent->d_name; *c >= '0' && *c <= '9'; c++) {
+        fd = fd * 10 + (*c - '0');
+      }
+      if (fd >= from && fd != dirfd) close(fd);
+    }
+  }
+
+  close(dirfd);
+  return 0;
+}
+
+#endif
+
+/* Close all fds from `from`, except `keep`. The number of system calls
+   does not depend on the fd limit, except on platforms that have neither
+   close_range() / closefrom() nor /proc/self/fd. There we close the fds
+   below `max_fd` one by one, and fds above 65536 stay open if the fd
+   limit is higher than that, see processx__child_max_fd(). */
+
+static void processx__child_close_fds(int from, int keep, int max_fd) {
+  int i;
+
+  if (keep >= from) {
+    /* Usually there are no fds below the error pipe */
+    if (keep > from && processx__close_range(from, keep - 1) == -1) {
+      for (i = from; i < keep; i++) close(i);
+    }
+    from = keep + 1;
+  }
+
+  if (processx__close_range(from, ~0U) == 0) return;
+
+#ifdef __linux__
+  if (processx__child_close_procfs(from) == 0) return;
+#endif
+
+  for (i = from; i < max_fd; i++) close(i);
+}
+
+void processx__child_init(processx__child_args_t *child) {
+
+  int close_fd, use_fd, fd;
+  int min_fd = 0;
+  int stdio_count = child->stdio_count;
+  int error_fd = child->error_fd;
+  int *fds = child->fds;
+
+  processx__child_reset_signals(&child->sigmask);
+
+  if (child->pty_main_fd >= 0) close(child->pty_main_fd);
+
+  setsid();
+
+  /* Do we need a pty? */
+  if (child->pty_name) {
+    /* Do not mess with stdin/stdout/stderr, all handled by the pty */
+    min_fd = 3;
+
+    int sub_fd = open(child->pty_name, O_RDWR);
+    if (sub_fd == -1) processx__child_fail(error_fd);
+
+#ifdef TIOCSCTTY
+    if (ioctl(sub_fd, TIOCSCTTY, 0) == -1) processx__child_fail(error_fd);
+#endif
+
+#ifdef TIOCSWINSZ
+    struct winsize w;
+    w.ws_row = child->pty_rows;
+    w.ws_col = child->pty_cols;
+    if (ioctl(sub_fd, TIOCSWINSZ, &w) == -1) processx__child_fail(error_fd);
+#endif
+
+    struct termios tp;
+
+    if (tcgetattr(sub_fd, &tp) == -1) processx__child_fail(error_fd);
+
+    if (child->pty_echo) {
+      tp.c_lflag |= ECHO;
+    } else {
+      tp.c_lflag &= ~ECHO;
+    }
+
+    if (tcsetattr(sub_fd, TCSAFLUSH, &tp) == -1) {
+      processx__child_fail(error_fd);
+    }
+
+    /* TODO: set other terminal attributes and size */
+
+    /* Duplicate pty sub to be child's stdin, stdout, and stderr */
+    if (dup2(sub_fd, STDIN_FILENO) != STDIN_FILENO) {
+      processx__child_fail(error_fd);
+    }
+    if (dup2(sub_fd, STDOUT_FILENO) != STDOUT_FILENO) {
+      processx__child_fail(error_fd);
+    }
+    if (dup2(sub_fd, STDERR_FILENO) != STDERR_FILENO) {
+      processx__child_fail(error_fd);
+    }
+
+    if (sub_fd > STDERR_FILENO) close(sub_fd);
+  }
+
+  /* We want to prevent use_fd < fd, because we will dup2() use_fd into
+     fd later. If use_fd >= fd, then this is always possible,
+     without mixing up stdin, stdout and stderr. Without this, we could
+     have a case when we dup2() 2 into 1, and then 1 is lost. */
+
+  for (fd = min_fd; fd < stdio_count; fd++) {
+    use_fd = fds[fd];
+    /* If use_fd < 0 then there is no pipe for fd. */
+    if (use_fd < 0 || use_fd >= fd) continue;
+    /* If use_fd < fd, then we create a brand new fd for it,
+       starting at stdio_count, which is bigger then fd, surely. */
+    fds[fd] = fcntl(use_fd, F_DUPFD, stdio_count);
+    if (fds[fd] == -1) processx__child_fail(error_fd);
+  }
+
+  /* This loop initializes the stdin, stdout, stderr fds of the child
+     process properly. */
+
+  for (fd = min_fd; fd < stdio_count; fd++) {
+    /* close_fd is an fd that must be closed. The parent's end of a
+       pipe is close-on-exec, so there is nothing to close initially. */
+    close_fd = -1;
+    /* use_fd is the fd that the child must use for stdin/out/err. */
+    use_fd = fds[fd];
+
+    if (child->modes[fd] == PROCESSX__CHILD_STDOUT) {
+      /* The 2>&1 case. */
+      use_fd = 1;
+
+    } else if (use_fd < 0) {
+      /* Otherwise we open a file. If the stdin/out/err is not
+	 requested, then we open a file to /dev/null */
+      /* For fd >= 3, the fd is just passed, and we just use it,
+	 no need to open any file */
+      if (child->modes[fd] == PROCESSX__CHILD_SKIP) continue;
+
+      if (child->modes[fd] == PROCESSX__CHILD_FILE) {
+	/* A file was requested, open it */
+	if (fd == 0) {
+	  use_fd = open(child->files[fd], O_RDONLY);
+	} else {
+	  use_fd = open(child->files[fd], O_CREAT | O_TRUNC| O_RDWR, 0644);
+	}
+      } else {
+	/* NULL, so stdin/out/err is ignored, using /dev/null */
+	use_fd = open("/dev/null", fd == 0 ? O_RDONLY : O_RDWR);
+      }
+      /* In the output file case, we might need to close use_fd, after
+	 we dup2()-d it into fd. */
+      close_fd = use_fd;
+
+      if (use_fd == -1) processx__child_fail(error_fd);
+    }
+
+    /* We will use use_fd for fd. If they happen to be equal, make
+       sure that fd is _not_ closed on exec. Otherwise dup2() use_fd
+       into fd. dup2() clears the CLOEXEC flag, so no need for a fcntl
+       call in this case. */
+    if (fd == use_fd) {
+      processx__cloexec_fcntl(use_fd, 0);
+    } else {
+      fd = dup2(use_fd, fd);
+    }
+
+    if (fd == -1) processx__child_fail(error_fd);
+
+    if (fd <= 2) processx__nonblock_fcntl(fd, 0);
+
+    /* If we have an extra fd, that we already dup2()-d into fd,
+       we can close it now. */
+    if (close_fd >= stdio_count) close(close_fd);
+  }
+
+  for (fd = min_fd; fd < stdio_count; fd++) {
+    use_fd = fds[fd];
+    if (use_fd >= stdio_count) close(use_fd);
+  }
+
+  processx__child_close_fds(stdio_count, error_fd, child->max_fd);
+
+  if (child->cwd != NULL && chdir(child->cwd)) {
+    processx__child_fail(error_fd);
+  }
+
+  if (child->wd != NULL && chdir(child->wd)) {
+    processx__child_fail(error_fd);
+  }
+
+  processx__child_execvpe(child);
+  processx__child_fail(error_fd);
+}
+
+/* Entry point for clone() */
+
+int processx__child_start(void *arg) {
+  processx__child_init((processx__child_args_t*) arg);
+  return 127;
+}
+
+/* LCOV_EXCL_STOP */
+
@@ -0,0 +1,85 @@
+
+#ifndef PROCESSX_UNIX_CHILD_H
+#define PROCESSX_UNIX_CHILD_H
+
+/* The code that runs in the child process, between the fork and the
+   exec. It does not use R, so the fork server helper can use it, too. */
+
+#include <signal.h>
+#include <sys/types.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/* close_range() has the same number on all architectures, except alpha,
+   but older kernel headers do not know about it. */
+
+#if defined(__linux__)
+#if defined(SYS_close_range)
+#define PROCESSX__NR_CLOSE_RANGE SYS_close_range
+#elif !defined(__alpha__)
+#define PROCESSX__NR_CLOSE_RANGE 436
+#endif
+#endif
+
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+/* What the child needs to do with one of its stdio fds */
+#define PROCESSX__CHILD_NULL   0  /* open /dev/null */
+#define PROCESSX__CHILD_FD     1  /* use a pipe, or an inherited fd */
+#define PROCESSX__CHILD_FILE   2  /* open a file */
+#define PROCESSX__CHILD_STDOUT 3  /* 2>&1 */
+#define PROCESSX__CHILD_SKIP   4  /* extra fd, nothing to pass */
+
+/* Everything the child needs between the fork and the exec. This is all
+   prepared in the parent, so the child does not allocate memory or touch
+   R objects. With CLONE_VM the child runs on the memory of the parent,
+   so the only things it may modify are `fds` and `sh_args[1]`. Every
+   child has its own copy of these, and the parent does not use them
+   after the child has started. */
+
+typedef struct processx__child_args_s {
+  const char *command;
+  char **args;
+  char **sh_args;		/* for running scripts without a #! line */
+  char **env;			/* complete environment, with the tree id */
+  const char *path;		/* PATH from `env` */
+  int stdio_count;
+  int *fds;
+  int *modes;
+  const char **files;
+  int error_fd;
+  int max_fd;			/* fd limit, if we need to close fds one by one */
+  int pty_main_fd;
+  const char *pty_name;
+  int pty_echo;
+  int pty_rows;
+  int pty_cols;
+  const char *cwd;		/* directory of the parent, if not ours */
+  const char *wd;
+  sigset_t sigmask;		/* signal mask for the child */
+} processx__child_args_t;
+
+void processx__child_init(processx__child_args_t *child);
+int processx__child_max_fd(void);
+int processx__child_start(void *arg);
+const char *processx__child_path(char **env);
+void processx__write_int(int fd, int err);
+
+int processx__nonblock_fcntl(int fd, int set);
+int processx__cloexec_fcntl(int fd, int set);
+
+/* The fork server protocol. Every request starts with a header: the
+   magic number and the length of the payload. The fds that the child
+   needs are sent with the header, as SCM_RIGHTS ancillary data. The
+   payload is a sequence of 32 bit integers and zero terminated strings,
+   see processx__forkserver_spawn(). The reply is a single 32 bit
+   integer, the pid of the new process, or a negative errno value. */
+
+#define PROCESSX__FORKSERVER_MAGIC 0x50584653 /* PXFS */
+#define PROCESSX__FORKSERVER_MAX_FDS 128
+
+#endif
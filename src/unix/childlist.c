@@ -1,11 +1,75 @@
 
 #include "../processx.h"
 
-processx__child_list_t child_list_head = { 0, 0, 0 };
-processx__child_list_t *child_list = &child_list_head;
-processx__child_list_t child_free_list_head = { 0, 0, 0 };
+#include <stdint.h>
+
+/* The children are kept in an open addressing hash table, keyed by
+   the pid, so that the SIGCHLD handler can find an exited child in
+   constant time. Entries are only added (and the table is only resized)
+   with SIGCHLD blocked, and they are only removed by the SIGCHLD handler
+   (or also with SIGCHLD blocked), so there is no race condition. Removed
+   entries are marked as deleted, and they are dropped when the table is
+   rebuilt. */
+
+processx__child_list_t **child_table = 0;
+size_t child_table_size = 0;	/* always a power of two */
+size_t child_table_count = 0;	/* number of children */
+size_t child_table_used = 0;	/* number of children and deleted slots */
+processx__child_list_t child_free_list_head = { 0, 0, 0, 0 };
 processx__child_list_t *child_free_list = &child_free_list_head;
 
+static processx__child_list_t processx__child_deleted = { 0, 0, 0, 0 };
+#define PROCESSX__CHILD_DELETED (&processx__child_deleted)
+#define PROCESSX__CHILD_TABLE_MIN 64
+
+/* The weak references of the children are kept alive in a single list,
+   that is preserved once, instead of preserving every one of them. R's
+   precious list is a linked list, so releasing objects from it is slow
+   if there are many of them. Free slots are kept on a stack. */
+
+SEXP child_registry = NULL;
+int *child_registry_free = 0;
+int child_registry_nfree = 0;
+
+static int processx__registry_grow(void) {
+  int i, old_size = child_registry ? LENGTH(child_registry) : 0;
+  int size = old_size ? old_size * 2 : 64;
+  int *free_slots;
+  SEXP registry;
+
+  free_slots = realloc(child_registry_free, sizeof(int) * size);
+  if (!free_slots) return 1;
+  child_registry_free = free_slots;
+
+  registry = PROTECT(allocVector(VECSXP, size));
+  for (i = 0; i < old_size; i++) {
+    SET_VECTOR_ELT(registry, i, VECTOR_ELT(child_registry, i));
+  }
+  R_PreserveObject(registry);
+  if (child_registry) R_ReleaseObject(child_registry);
+  child_registry = registry;
+  UNPROTECT(1);
+
+  /* Push the new slots, so that the smallest one is on the top */
+  for (i = size - 1; i >= old_size; i--) {
+    child_registry_free[child_registry_nfree++] = i;
+  }
+  return 0;
+}
+
+static int processx__registry_add(SEXP x) {
+  int idx;
+  if (child_registry_nfree == 0 && processx__registry_grow()) return -1;
+  idx = child_registry_free[--child_registry_nfree];
+  SET_VECTOR_ELT(child_registry, idx, x);
+  return idx;
+}
+
+static void processx__registry_remove(int idx) {
+  SET_VECTOR_ELT(child_registry, idx, R_NilValue);
+  child_registry_free[child_registry_nfree++] = idx;
+}
+
 void processx__freelist_add(processx__child_list_t *ptr) {
   ptr->next = child_free_list->next;
   child_free_list->next = ptr;
@@ -18,7 +82,7 @@ void processx__freelist_free(void) {
   processx__child_list_t *ptr = child_free_list->next;
   while (ptr) {
     processx__child_list_t *next = ptr->next;
-    R_ReleaseObject(ptr->weak_status);
+    processx__registry_remove(ptr->registry_idx);
     free(ptr);
     ptr = next;
   }
@@ -29,62 +93,149 @@ void processx__child_finalizer(SEXP x) {
   /* Nothing to do here, there is a finalizer on the xPTR */
 }
 
+static size_t processx__child_hash(pid_t pid) {
+  /* Fibonacci hashing, pids are often consecutive */
+  return (size_t) ((uint32_t) pid * 2654435761U);
+}
+
+/* Slot of `pid`, or the empty slot where it should go */
+
+static size_t processx__child_slot(processx__child_list_t **table,
+                                   size_t size, pid_t pid) {
+  size_t mask = size - 1;
+  size_t i = processx__child_hash(pid) & mask;
+  while (table[i]) {
+    if (table[i] != PROCESSX__CHILD_DELETED && table[i]->pid == pid) break;
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+static int processx__child_table_resize(size_t size) {
+  processx__child_list_t **table = calloc(size, sizeof(*table));
+  size_t i;
+  if (!table) return 1;
+  for (i = 0; i < child_table_size; i++) {
+    processx__child_list_t *ptr = child_table[i];
+    if (ptr && ptr != PROCESSX__CHILD_DELETED) {
+      table[processx__child_slot(table, size, ptr->pid)] = ptr;
+    }
+  }
+  free(child_table);
+  child_table = table;
+  child_table_size = size;
+  child_table_used = child_table_count;
+  return 0;
+}
+
 int processx__child_add(pid_t pid, SEXP status) {
-  processx__child_list_t *child = calloc(1, sizeof(processx__child_list_t));
+  processx__child_list_t *child;
   SEXP weak_ref;
+  size_t slot;
+
+  /* Keep the load factor below 3/4, including the deleted slots. Only
+     grow if the table is at least half full with children, otherwise
+     just drop the deleted slots. */
+  if ((child_table_used + 1) * 4 > child_table_size * 3) {
+    size_t size = child_table_size;
+    if (size < PROCESSX__CHILD_TABLE_MIN) {
+      size = PROCESSX__CHILD_TABLE_MIN;
+    } else if ((child_table_count + 1) * 2 > size) {
+      size *= 2;
+    }
+    if (processx__child_table_resize(size)) return 1;
+  }
+
+  child = calloc(1, sizeof(processx__child_list_t));
   if (!child) return 1;
 
-  weak_ref = R_MakeWeakRefC(status, R_NilValue, processx__child_finalizer, 1);
+  weak_ref = PROTECT(
+    R_MakeWeakRefC(status, R_NilValue, processx__child_finalizer, 1));
 
   child->pid = pid;
-  R_PreserveObject(weak_ref);
+  child->registry_idx = processx__registry_add(weak_ref);
+  UNPROTECT(1);
+  if (child->registry_idx == -1) {
+    free(child);
+    return 1;
+  }
   child->weak_status = weak_ref;
-  child->next = child_list->next;
-  child_list->next = child;
+
+  slot = processx__child_slot(child_table, child_table_size, pid);
+  if (child_table[slot]) {
+    /* A reused pid. The old child was reaped by someone else, so its
+       exit status is unknown. Collecting it removes it from the table. */
+    processx__child_list_t *old = child_table[slot];
+    SEXP old_status = R_WeakRefKey(old->weak_status);
+    if (!isNull(old_status) && R_ExternalPtrAddr(old_status)) {
+      processx__collect_exit_status(old_status, -1, 0, NULL);
+    }
+    processx__child_remove(pid);
+    slot = processx__child_slot(child_table, child_table_size, pid);
+  }
+  child_table_used++;
+  child_table_count++;
+  child_table[slot] = child;
   return 0;
 }
 
-/* This is actually not used currently. But it should work fine. */
-/* LCOV_EXCL_START */
+/* This is called from the SIGCHLD handler, so it cannot allocate
+   memory. */
 
 void processx__child_remove(pid_t pid) {
-  processx__child_list_t *prev = child_list, *ptr = child_list->next;
-  while (ptr) {
-    if (ptr->pid == pid) {
-      prev->next = ptr->next;
-      /* Defer freeing the memory, because malloc/free are typically not
-	 reentrant, and if we free in the SIGCHLD handler, that can cause
-	 crashes. The test case in test-run.R (see comments there)
-	 typically brings this out. */
-      processx__freelist_add(ptr);
-      return;
-    }
-    prev = ptr;
-    ptr = ptr->next;
-  }
+  size_t slot;
+  processx__child_list_t *ptr;
+  if (!child_table) return;
+  slot = processx__child_slot(child_table, child_table_size, pid);
+  ptr = child_table[slot];
+  if (!ptr) return;
+  child_table[slot] = PROCESSX__CHILD_DELETED;
+  child_table_count--;
+  /* Defer freeing the memory, because malloc/free are typically not
+     reentrant, and if we free in the SIGCHLD handler, that can cause
+     crashes. The test case in test-run.R (see comments there)
+     typically brings this out. */
+  processx__freelist_add(ptr);
 }
 
-/* This is actually not used currently. But it should work fine. */
+/* Remove the child after its exit status was collected, if it is still
+   in the table. The pid might belong to a newer child already, so we
+   check that the entry is for `status`. */
+
+void processx__child_forget(pid_t pid, SEXP status) {
+  processx__child_list_t *ptr = processx__child_find(pid);
+  if (ptr && R_WeakRefKey(ptr->weak_status) == status) {
+    processx__child_remove(pid);
+  }
+}
 
 processx__child_list_t *processx__child_find(pid_t pid) {
-  processx__child_list_t *ptr = child_list->next;
-  while (ptr) {
-    if (ptr->pid == pid) return ptr;
-    ptr = ptr->next;
+  size_t slot;
+  if (!child_table) return 0;
+  slot = processx__child_slot(child_table, child_table_size, pid);
+  return child_table[slot];
+}
+
+/* Iterate over all children, start with `*idx == 0`. Removing the
+   current child during the iteration is fine. */
+
+processx__child_list_t *processx__child_next(size_t *idx) {
+  while (*idx < child_table_size) {
+    processx__child_list_t *ptr = child_table[(*idx)++];
+    if (ptr && ptr != PROCESSX__CHILD_DELETED) return ptr;
   }
   return 0;
 }
 
-/* LCOV_EXCL_STOP */
-
 SEXP processx__unload_cleanup(void) {
-  processx__child_list_t *ptr = child_list->next;
+  processx__child_list_t *ptr;
+  size_t idx = 0;
   int killed = 0;
 
   processx__remove_sigchld();
+  processx__drain_stop_thread();
 
-  while (ptr) {
-    processx__child_list_t *next = ptr->next;
+  while ((ptr = processx__child_next(&idx))) {
     SEXP status = R_WeakRefKey(ptr->weak_status);
     processx_handle_t *handle =
       isNull(status) ? 0 : (processx_handle_t*) R_ExternalPtrAddr(status);
@@ -105,13 +256,19 @@ SEXP processx__unload_cleanup(void) {
        a race condition here. */
 
     free(ptr);
-
-    ptr = next;
   }
 
-  child_list->next = 0;
+  free(child_table);
+  child_table = 0;
+  child_table_size = child_table_count = child_table_used = 0;
   processx__freelist_free();
 
+  if (child_registry) R_ReleaseObject(child_registry);
+  child_registry = NULL;
+  free(child_registry_free);
+  child_registry_free = 0;
+  child_registry_nfree = 0;
+
   if (killed > 0) {
     REprintf("Unloading processx shared library, killed %d processes\n",
 	     killed);
@@ -0,0 +1,367 @@
+#include "../processx.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Background reader thread
+ *
+ * A connection can be drained by a background thread, so that the
+ * process on the other end does not block on a full pipe, even if R is
+ * busy. There is a single thread for all drained connections. It reads
+ * the data into a growable buffer, and the connection reads from this
+ * buffer instead of its file descriptor. Every drained connection has a
+ * notification pipe, that is readable if the buffer has data, or after
+ * EOF. Polling the connection polls this pipe instead of the fd.
+ *
+ * The thread never calls R. If a read fails, it saves the errno, and
+ * the main thread reports the error when it reads the connection.
+ *
+ * For a connection in tail capture mode only the tail is needed, so
+ * the buffer has a limit, and the thread drops the oldest data above it.
+ *
+ * A single mutex protects all data here. The thread does not hold it
+ * while it is waiting in poll(). The main thread might remove a
+ * connection while the thread is polling it, so after poll() the
+ * thread only reads if the list of connections has not changed.
+ */
+
+struct processx_drain_s {
+  int fd;
+  char *data;
+  size_t begin;
+  size_t size;
+  size_t alloc;
+  int eof;			/* EOF, or error, no more reads */
+  int error;			/* errno of a failed read(), or 0 */
+  int notify[2];		/* readable if there is data, or EOF */
+  int signaled;			/* whether `notify` is readable now */
+  size_t limit;			/* keep at most this many bytes, or 0 */
+  struct processx_drain_s *next;
+};
+
+#define PROCESSX__DRAIN_READ (64 * 1024)
+
+static pthread_mutex_t processx__drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t processx__drain_thread;
+static int processx__drain_running = 0;
+static int processx__drain_stopping = 0;
+static int processx__drain_wakeup[2] = { -1, -1 };
+static processx_drain_t *processx__drains = NULL;
+static unsigned int processx__drain_generation = 0;
+
+/* These need the lock */
+
+static void processx__drain_signal(processx_drain_t *drain) {
+  char c = 0;
+  ssize_t ret;
+  if (drain->signaled) return;
+  do {
+    ret = write(drain->notify[1], &c, 1);
+  } while (ret == -1 && errno == EINTR);
+  drain->signaled = 1;
+}
+
+static void processx__drain_unsignal(processx_drain_t *drain) {
+  char buf[16];
+  ssize_t ret;
+  if (!drain->signaled) return;
+  do {
+    ret = read(drain->notify[0], buf, sizeof(buf));
+  } while (ret > 0 || (ret == -1 && errno == EINTR));
+  drain->signaled = 0;
+}
+
+static void processx__drain_read(processx_drain_t *drain) {
+  ssize_t ret;
+
+  if (drain->alloc - drain->begin - drain->size < PROCESSX__DRAIN_READ) {
+    if (drain->begin > 0) {
+      memmove(drain->data, drain->data + drain->begin, drain->size);
+      drain->begin = 0;
+    }
+    if (drain->alloc - drain->size < PROCESSX__DRAIN_READ) {
+      size_t alloc = drain->alloc ? drain->alloc * 2 : PROCESSX__DRAIN_READ;
+      char *data = realloc(drain->data, alloc);
+      if (!data) {
+	drain->error = ENOMEM;
+	drain->eof = 1;
+	processx__drain_signal(drain);
+	return;
+      }
+      drain->data = data;
+      drain->alloc = alloc;
+    }
+  }
+
+  do {
+    ret = read(drain->fd, drain->data + drain->begin + drain->size,
+	       drain->alloc - drain->begin - drain->size);
+  } while (ret == -1 && errno == EINTR);
+
+  if (ret > 0) {
+    drain->size += ret;
+    if (drain->limit && drain->size > drain->limit) {
+      /* Do not start with a partial UTF-8 character, if we can help it */
+      size_t drop = drain->size - drain->limit;
+      while (drop < drain->size &&
+             ((unsigned char) drain->data[drain->begin + drop] & 0xC0) == 0x80) {
+        drop++;
+      }
+      drain->begin += drop;
+      drain->size -= drop;
+      if (drain->size == 0) drain->begin = 0;
+    }
+    processx__drain_signal(drain);
+  } else if (ret == 0) {
+    drain->eof = 1;
+    processx__drain_signal(drain);
+  } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+    drain->error = errno;
+    drain->eof = 1;
+    processx__drain_signal(drain);
+  }
+}
+
+static void processx__drain_wake(void) {
+  char c = 0;
+  ssize_t ret;
+  do {
+    ret = write(processx__drain_wakeup[1], &c, 1);
+  } while (ret == -1 && errno == EINTR);
+}
+
+static void *processx__drain_main(void *arg) {
+  size_t nalloc = 1;
+  struct pollfd *fds = malloc(sizeof(struct pollfd));
+  processx_drain_t **drains = malloc(sizeof(processx_drain_t*));
+
+  if (!fds || !drains) {
+    free(fds);
+    free(drains);
+    return NULL;
+  }
+
+  while (1) {
+    processx_drain_t *drain;
+    unsigned int generation;
+    size_t i, n = 1;
+    int ret, oom = 0;
+
+    pthread_mutex_lock(&processx__drain_lock);
+    if (processx__drain_stopping) {
+      pthread_mutex_unlock(&processx__drain_lock);
+      break;
+    }
+    generation = processx__drain_generation;
+    for (drain = processx__drains; drain; drain = drain->next) {
+      if (!drain->eof) n++;
+    }
+    if (n > nalloc) {
+      struct pollfd *nfds = realloc(fds, n * sizeof(struct pollfd));
+      processx_drain_t **ndrains = NULL;
+      if (nfds) fds = nfds;
+      if (nfds) ndrains = realloc(drains, n * sizeof(processx_drain_t*));
+      if (ndrains) drains = ndrains;
+      if (!nfds || !ndrains) {
+	/* Try again a bit later */
+	n = 1;
+	oom = 1;
+      } else {
+	nalloc = n;
+      }
+    }
+    fds[0].fd = processx__drain_wakeup[0];
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    for (i = 1, drain = processx__drains; drain && i < n;
+	 drain = drain->next) {
+      if (drain->eof) continue;
+      fds[i].fd = drain->fd;
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+      drains[i] = drain;
+      i++;
+    }
+    pthread_mutex_unlock(&processx__drain_lock);
+
+    ret = poll(fds, (nfds_t) n, oom ? 100 : -1);
+    if (ret <= 0) continue;
+
+    if (fds[0].revents) {
+      char buf[64];
+      while (read(processx__drain_wakeup[0], buf, sizeof(buf)) > 0) ;
+    }
+
+    pthread_mutex_lock(&processx__drain_lock);
+    if (generation == processx__drain_generation) {
+      for (i = 1; i < n; i++) {
+	if (fds[i].revents) processx__drain_read(drains[i]);
+      }
+    }
+    pthread_mutex_unlock(&processx__drain_lock);
+  }
+
+  free(fds);
+  free(drains);
+  return NULL;
+}
+
+/* Start the thread if it is not running yet. It does not handle any
+   signals, they should go to the main thread. */
+
+static void processx__drain_start_thread(void) {
+  sigset_t all, old;
+  int ret;
+
+  if (processx__drain_running) return;
+
+  if (processx__drain_wakeup[0] < 0) {
+    if (pipe(processx__drain_wakeup)) {
+      R_THROW_SYSTEM_ERROR("Cannot create pipe for background reader");
+    }
+    processx__cloexec_fcntl(processx__drain_wakeup[0], 1);
+    processx__cloexec_fcntl(processx__drain_wakeup[1], 1);
+    processx__nonblock_fcntl(processx__drain_wakeup[0], 1);
+    processx__nonblock_fcntl(processx__drain_wakeup[1], 1);
+  }
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  ret = pthread_create(&processx__drain_thread, NULL, processx__drain_main,
+		       NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (ret) {
+    R_THROW_SYSTEM_ERROR_CODE(ret, "Cannot start background reader thread");
+  }
+  processx__drain_running = 1;
+}
+
+/* Stop the thread, e.g. when the package is unloaded. The connections
+   can still read what was buffered. */
+
+void processx__drain_stop_thread(void) {
+  if (!processx__drain_running) return;
+  pthread_mutex_lock(&processx__drain_lock);
+  processx__drain_stopping = 1;
+  pthread_mutex_unlock(&processx__drain_lock);
+  processx__drain_wake();
+  pthread_join(processx__drain_thread, NULL);
+  processx__drain_running = 0;
+  processx__drain_stopping = 0;
+}
+
+/* Start draining a connection. If `limit` is not zero, then only the
+   last `limit` bytes are kept in the buffer. If the connection is drained
+   already, then this only updates the limit. */
+
+void processx__drain_add(processx_connection_t *ccon, size_t limit) {
+  processx_drain_t *drain;
+
+  if (ccon->drain) {
+    if (limit) {
+      pthread_mutex_lock(&processx__drain_lock);
+      ccon->drain->limit = limit;
+      pthread_mutex_unlock(&processx__drain_lock);
+    }
+    return;
+  }
+  processx__drain_start_thread();
+
+  drain = calloc(1, sizeof(processx_drain_t));
+  if (!drain) R_THROW_ERROR("Cannot allocate memory for background reader");
+  drain->fd = ccon->handle;
+  drain->limit = limit;
+  if (pipe(drain->notify)) {
+    free(drain);
+    R_THROW_SYSTEM_ERROR("Cannot create pipe for background reader");
+  }
+  processx__cloexec_fcntl(drain->notify[0], 1);
+  processx__cloexec_fcntl(drain->notify[1], 1);
+  processx__nonblock_fcntl(drain->notify[0], 1);
+  processx__nonblock_fcntl(drain->notify[1], 1);
+
+  pthread_mutex_lock(&processx__drain_lock);
+  drain->next = processx__drains;
+  processx__drains = drain;
+  processx__drain_generation++;
+  pthread_mutex_unlock(&processx__drain_lock);
+
+  ccon->drain = drain;
+  processx__drain_wake();
+}
+
+/* Stop draining, before the connection is closed. Buffered data is
+   dropped. */
+
+void processx__drain_remove(processx_connection_t *ccon) {
+  processx_drain_t *drain = ccon->drain, **ptr;
+  if (!drain) return;
+
+  pthread_mutex_lock(&processx__drain_lock);
+  for (ptr = &processx__drains; *ptr; ptr = &(*ptr)->next) {
+    if (*ptr == drain) {
+      *ptr = drain->next;
+      break;
+    }
+  }
+  processx__drain_generation++;
+  pthread_mutex_unlock(&processx__drain_lock);
+  if (processx__drain_running) processx__drain_wake();
+
+  close(drain->notify[0]);
+  close(drain->notify[1]);
+  free(drain->data);
+  free(drain);
+  ccon->drain = NULL;
+}
+
+/* Like read() on the fd, but from the buffer. Returns -1 and sets
+   errno to EAGAIN if there is no data now. */
+
+ssize_t processx__drain_take(processx_drain_t *drain, char *target,
+			     size_t nbyte) {
+  ssize_t ret;
+
+  pthread_mutex_lock(&processx__drain_lock);
+  if (drain->size > 0) {
+    size_t n = drain->size < nbyte ? drain->size : nbyte;
+    memcpy(target, drain->data + drain->begin, n);
+    drain->begin += n;
+    drain->size -= n;
+    if (drain->size == 0) drain->begin = 0;
+    ret = n;
+  } else if (drain->error) {
+    errno = drain->error;
+    ret = -1;
+  } else if (drain->eof) {
+    ret = 0;
+  } else {
+    errno = EAGAIN;
+    ret = -1;
+  }
+  if (drain->size == 0 && !drain->eof) processx__drain_unsignal(drain);
+  pthread_mutex_unlock(&processx__drain_lock);
+
+  return ret;
+}
+
+/* Number of bytes in the buffer */
+
+size_t processx__drain_size(processx_drain_t *drain) {
+  size_t size;
+  pthread_mutex_lock(&processx__drain_lock);
+  size = drain->size;
+  pthread_mutex_unlock(&processx__drain_lock);
+  return size;
+}
+
+/* This is what we poll instead of the connection's fd */
+
+int processx__drain_fd(processx_drain_t *drain) {
+  return drain->notify[0];
+}
@@ -0,0 +1,305 @@
+
+#include "../processx.h"
+
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+/* The fork server is a small helper process that starts subprocesses
+   for us. It is started early, while the R process is still small, and
+   its children are started with CLONE_PARENT, so they are our children.
+   waitpid(), kill(), SIGCHLD, etc. all work the same way as for the
+   processes that we start ourselves. Only supported on Linux. */
+
+static int processx__forkserver_fd = -1;
+static pid_t processx__forkserver_pid = 0;
+
+/* The server quits when its socket is closed. We give it a second for
+   that, then kill it, so a stuck server cannot hang R. SIGCHLD is
+   blocked here, so the handler cannot reap the server meanwhile. */
+
+#define PROCESSX__FORKSERVER_QUIT_MS 1000
+
+static void processx__forkserver_close(void) {
+  int wstat, i;
+  pid_t ret;
+  sigset_t set, old;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &set, &old);
+
+  if (processx__forkserver_fd >= 0) close(processx__forkserver_fd);
+  processx__forkserver_fd = -1;
+
+  if (processx__forkserver_pid > 0) {
+    for (i = 0; i < PROCESSX__FORKSERVER_QUIT_MS / 10; i++) {
+      struct timespec ts = { 0, 10 * 1000 * 1000 };
+      do {
+        ret = waitpid(processx__forkserver_pid, &wstat, WNOHANG);
+      } while (ret == -1 && errno == EINTR);
+      if (ret != 0) break;
+      nanosleep(&ts, NULL);
+    }
+    if (ret == 0) {
+      kill(processx__forkserver_pid, SIGKILL);
+      do {
+        ret = waitpid(processx__forkserver_pid, &wstat, 0);
+      } while (ret == -1 && errno == EINTR);
+    }
+  }
+  processx__forkserver_pid = 0;
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+#ifdef __linux__
+
+/* If `buf` is NULL, then these only calculate the size of the payload */
+
+static size_t processx__forkserver_int(char *buf, size_t pos, int x) {
+  int32_t x32 = x;
+  if (buf) memcpy(buf + pos, &x32, sizeof(x32));
+  return pos + sizeof(x32);
+}
+
+static size_t processx__forkserver_str(char *buf, size_t pos,
+                                       const char *str) {
+  size_t len = strlen(str ? str : "") + 1;
+  if (buf) memcpy(buf + pos, str ? str : "", len);
+  return pos + len;
+}
+
+static size_t processx__forkserver_payload(char *buf,
+                                           processx__child_args_t *child,
+                                           int *fdidx, const char *cwd) {
+  size_t pos = 0;
+  int i, n;
+
+  pos = processx__forkserver_int(buf, pos, child->stdio_count);
+  pos = processx__forkserver_int(buf, pos, child->pty_echo);
+  pos = processx__forkserver_int(buf, pos, child->pty_rows);
+  pos = processx__forkserver_int(buf, pos, child->pty_cols);
+  for (i = 0; i < child->stdio_count; i++) {
+    pos = processx__forkserver_int(buf, pos, fdidx[i]);
+    pos = processx__forkserver_int(buf, pos, child->modes[i]);
+    pos = processx__forkserver_str(buf, pos, child->files[i]);
+  }
+  pos = processx__forkserver_str(buf, pos, child->command);
+  pos = processx__forkserver_str(buf, pos, cwd);
+  pos = processx__forkserver_str(buf, pos, child->wd);
+  pos = processx__forkserver_str(buf, pos, child->pty_name);
+
+  for (n = 0; child->args[n]; n++) ;
+  pos = processx__forkserver_int(buf, pos, n);
+  for (i = 0; i < n; i++) {
+    pos = processx__forkserver_str(buf, pos, child->args[i]);
+  }
+  for (n = 0; child->env[n]; n++) ;
+  pos = processx__forkserver_int(buf, pos, n);
+  for (i = 0; i < n; i++) {
+    pos = processx__forkserver_str(buf, pos, child->env[i]);
+  }
+
+  return pos;
+}
+
+static int processx__forkserver_send(const char *buf, size_t len) {
+  ssize_t ret;
+  while (len > 0) {
+    ret = send(processx__forkserver_fd, buf, len, MSG_NOSIGNAL);
+    if (ret == -1 && errno == EINTR) continue;
+    if (ret == -1) return -1;
+    buf += ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+/* Returns the pid of the new process, or -1 and sets errno if it could
+   not be started. Returns -2 if the fork server cannot be used, and then
+   the caller needs to start the process itself. This is called with
+   SIGCHLD blocked, so it must not throw R errors. */
+
+pid_t processx__forkserver_spawn(processx__child_args_t *child) {
+  int fds[PROCESSX__FORKSERVER_MAX_FDS];
+  int fdidx[PROCESSX__FORKSERVER_MAX_FDS];
+  int nfds = 0, i;
+  char cwd[PATH_MAX];
+  char *payload = NULL;
+  size_t len;
+  uint32_t header[2];
+  int32_t reply;
+  ssize_t ret;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * PROCESSX__FORKSERVER_MAX_FDS)];
+  } cmsgbuf;
+
+  if (processx__forkserver_fd < 0) return -2;
+  if (child->stdio_count >= PROCESSX__FORKSERVER_MAX_FDS) return -2;
+  if (!getcwd(cwd, sizeof(cwd))) return -2;
+
+  /* The error pipe is always the first fd */
+  fds[nfds++] = child->error_fd;
+  for (i = 0; i < child->stdio_count; i++) {
+    if (child->fds[i] >= 0) {
+      fdidx[i] = nfds;
+      fds[nfds++] = child->fds[i];
+    } else {
+      fdidx[i] = -1;
+    }
+  }
+
+  len = processx__forkserver_payload(NULL, child, fdidx, cwd);
+  payload = malloc(len);
+  if (!payload) return -2;
+  processx__forkserver_payload(payload, child, fdidx, cwd);
+
+  header[0] = PROCESSX__FORKSERVER_MAGIC;
+  header[1] = (uint32_t) len;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(&cmsgbuf, 0, sizeof(cmsgbuf));
+  iov.iov_base = header;
+  iov.iov_len = sizeof(header);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsgbuf.buf;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+
+  do {
+    ret = sendmsg(processx__forkserver_fd, &msg, MSG_NOSIGNAL);
+  } while (ret == -1 && errno == EINTR);
+  if (ret != sizeof(header) ||
+      processx__forkserver_send(payload, len) == -1) {
+    free(payload);
+    goto failed;
+  }
+  free(payload);
+
+  do {
+    ret = recv(processx__forkserver_fd, &reply, sizeof(reply), MSG_WAITALL);
+  } while (ret == -1 && errno == EINTR);
+  if (ret != sizeof(reply)) goto failed;
+
+  if (reply < 0) {
+    errno = -reply;
+    return -1;
+  }
+
+  return (pid_t) reply;
+
+ failed:
+  /* The server is gone, do not try it again */
+  processx__forkserver_close();
+  return -2;
+}
+
+#else
+
+pid_t processx__forkserver_spawn(processx__child_args_t *child) {
+  return -2;
+}
+
+#endif
+
+SEXP processx_forkserver_start(SEXP path) {
+#ifndef __linux__
+  R_THROW_ERROR("The processx fork server is only supported on Linux");
+  return R_NilValue;
+#else
+  const char *cpath = CHAR(STRING_ELT(path, 0));
+  int sv[2], err;
+  uint32_t hello = 0;
+  ssize_t ret;
+  pid_t pid;
+
+  if (processx__forkserver_fd >= 0) {
+    return ScalarInteger(processx__forkserver_pid);
+  }
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    R_THROW_SYSTEM_ERROR("Cannot create socket for processx fork server");
+  }
+  processx__cloexec_fcntl(sv[0], 1);
+  processx__cloexec_fcntl(sv[1], 1);
+
+  pid = fork();
+
+  if (pid == -1) {
+    err = errno;
+    close(sv[0]);
+    close(sv[1]);
+    R_THROW_SYSTEM_ERROR_CODE(err, "Cannot start processx fork server");
+  }
+
+  /* LCOV_EXCL_START */
+  if (pid == 0) {
+    /* The server gets its end of the socket as fd 3 */
+    if (sv[1] == 3) {
+      processx__cloexec_fcntl(3, 0);
+    } else if (dup2(sv[1], 3) == -1) {
+      _exit(127);
+    }
+    execl(cpath, cpath, (char*) NULL);
+    _exit(127);
+  }
+  /* LCOV_EXCL_STOP */
+
+  close(sv[1]);
+  processx__forkserver_fd = sv[0];
+  processx__forkserver_pid = pid;
+
+  /* Wait until it is ready. If it could not start, then we get EOF. */
+  do {
+    ret = recv(sv[0], &hello, sizeof(hello), MSG_WAITALL);
+  } while (ret == -1 && errno == EINTR);
+
+  if (ret != sizeof(hello) || hello != PROCESSX__FORKSERVER_MAGIC) {
+    processx__forkserver_close();
+    R_THROW_ERROR("Cannot start processx fork server '%s'", cpath);
+  }
+
+  return ScalarInteger(pid);
+#endif
+}
+
+/* Called from the SIGCHLD handler, for an exited child that is not in
+   the child table. Returns 1 if it was the fork server, and we reaped
+   it. */
+
+int processx__forkserver_reap(pid_t pid) {
+  int wstat;
+  pid_t ret;
+  if (pid <= 0 || pid != processx__forkserver_pid) return 0;
+  do {
+    ret = waitpid(pid, &wstat, WNOHANG);
+  } while (ret == -1 && errno == EINTR);
+  if (ret != pid) return 0;
+  /* The socket is closed later, the next request will fail */
+  processx__forkserver_pid = 0;
+  return 1;
+}
+
+SEXP processx_forkserver_stop(void) {
+  processx__forkserver_close();
+  return R_NilValue;
+}
+
+SEXP processx_forkserver_pid(void) {
+  if (processx__forkserver_fd < 0) return R_NilValue;
+  return ScalarInteger(processx__forkserver_pid);
+}
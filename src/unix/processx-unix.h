@@ -4,8 +4,12 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/signal.h>
+#include <sys/resource.h>
+#include <stdint.h>
 #include <pthread.h>
 
+#include "child.h"
+
 # ifndef O_CLOEXEC
 #  define O_CLOEXEC 02000000
 # endif
@@ -21,15 +25,25 @@ typedef struct processx_handle_s {
   int fd0;			/* writeable */
   int fd1;			/* readable */
   int fd2;			/* readable */
-  int waitpipe[2];		/* use it for wait() with timeout */
   int cleanup;
   double create_time;
   processx_connection_t *pipes[3];
   int ptyfd;
+  int exec_fd;			/* exec status pipe, for async start */
+  int exec_errno;		/* -errno if exec failed in async start */
+  int pidfd;			/* pidfd on Linux, or -1 */
+  int exitpipe[2];		/* closed by SIGCHLD, for wait() and polling */
+  int has_rusage;		/* whether `rusage` was filled in by wait4() */
+  struct rusage rusage;
+  int64_t spawn_ns;		/* CLOCK_MONOTONIC times, zero if unknown */
+  int64_t exec_ns;
+  int64_t exit_ns;		/* when SIGCHLD arrived */
+  int64_t reap_ns;
 } processx_handle_t;
 
 char *processx__tmp_string(SEXP str, int i);
 char **processx__tmp_character(SEXP chr);
+int64_t processx__now_ns(void);
 
 extern pthread_t processx__main_thread;
 void processx__sigchld_callback(int sig, siginfo_t *info, void *ctx);
@@ -39,25 +53,41 @@ void processx__block_sigchld(void);
 void processx__unblock_sigchld(void);
 
 void processx__finalizer(SEXP status);
+int processx__exit_fd(processx_handle_t *handle);
 
-/* Child list and its functions */
+/* Child table and its functions, `next` is only used in the free list */
 
 typedef struct processx__child_list_s {
   pid_t pid;
   SEXP weak_status;
+  int registry_idx;		/* where `weak_status` is preserved */
   struct processx__child_list_s *next;
 } processx__child_list_t;
 
 int processx__child_add(pid_t pid, SEXP status);
 void processx__child_remove(pid_t pid);
+void processx__child_forget(pid_t pid, SEXP status);
 processx__child_list_t *processx__child_find(pid_t pid);
+processx__child_list_t *processx__child_next(size_t *idx);
 void processx__freelist_add(processx__child_list_t *ptr);
 void processx__freelist_free(void);
 
-void processx__collect_exit_status(SEXP status, int retval, int wstat);
+void processx__collect_exit_status(SEXP status, int retval, int wstat,
+				   const struct rusage *rusage);
+
+/* Background reader thread, in drain.c */
+
+void processx__drain_add(processx_connection_t *ccon, size_t limit);
+void processx__drain_remove(processx_connection_t *ccon);
+void processx__drain_stop_thread(void);
+ssize_t processx__drain_take(processx_drain_t *drain, char *target,
+			     size_t nbyte);
+size_t processx__drain_size(processx_drain_t *drain);
+int processx__drain_fd(processx_drain_t *drain);
 
 int processx__nonblock_fcntl(int fd, int set);
 int processx__cloexec_fcntl(int fd, int set);
+int processx__cloexec_all_fds(int firstfd);
 
 /* Control connections*/
 
@@ -77,4 +107,9 @@ void processx__make_socketpair(int pipe[2], const char *name);
 
 double processx__create_time(long pid);
 
+/* Fork server */
+
+pid_t processx__forkserver_spawn(processx__child_args_t *child);
+int processx__forkserver_reap(pid_t pid);
+
 #endif
@@ -14,12 +14,6 @@
 
 /* Internals */
 
-static void processx__child_init(processx_handle_t *handle, SEXP connections,
-				 int (*pipes)[2], int stdio_count,
-				 char *command, char **args,
-				 int error_fd, const char *pty_name, char **env,
-                                 processx_options_t *options,
-				 const char *tree_id);
 
 static SEXP processx__make_handle(SEXP private, int cleanup);
 static void processx__handle_destroy(processx_handle_t *handle);
@@ -52,13 +46,74 @@ extern char **environ;
 #include <sys/ioctl.h>
 #include <pthread.h>
 
-extern processx__child_list_t child_list_head;
-extern processx__child_list_t *child_list;
+/* On Linux we start the child with clone(CLONE_VM | CLONE_VFORK), like
+   vfork(), so we do not need to copy the page tables of the (possibly
+   huge) R process. Architectures with an upwards growing stack, or
+   a different clone() signature are left out. */
+
+#if defined(__linux__) && !defined(__hppa__) && !defined(__ia64__)
+#define PROCESSX__USE_CLONE 1
+#include <sched.h>
+#include <sys/mman.h>
+#define PROCESSX__CLONE_STACK_SIZE (128 * 1024)
+static char *processx__clone_stack = NULL;
+#endif
+
+/* On Linux we also keep a pidfd for every child, if the kernel has
+   pidfd_open(). It refers to our child, even if the pid is reused, and
+   it is readable once the child has exited. These syscalls have the same
+   number on all architectures, except alpha. */
+
+#if defined(__linux__)
+#if defined(SYS_pidfd_open)
+#define PROCESSX__NR_PIDFD_OPEN SYS_pidfd_open
+#elif !defined(__alpha__)
+#define PROCESSX__NR_PIDFD_OPEN 434
+#endif
+#if defined(SYS_pidfd_send_signal)
+#define PROCESSX__NR_PIDFD_SEND_SIGNAL SYS_pidfd_send_signal
+#elif !defined(__alpha__)
+#define PROCESSX__NR_PIDFD_SEND_SIGNAL 424
+#endif
+#endif
+
+static int processx__pidfd_open(pid_t pid) {
+#if defined(PROCESSX__NR_PIDFD_OPEN) && defined(PROCESSX__NR_PIDFD_SEND_SIGNAL)
+  static int no_pidfd = 0;
+  int fd;
+  if (no_pidfd) return -1;
+  /* The pidfd is close-on-exec */
+  fd = (int) syscall(PROCESSX__NR_PIDFD_OPEN, pid, 0);
+  if (fd == -1 && (errno == ENOSYS || errno == EPERM)) no_pidfd = 1;
+  return fd;
+#else
+  return -1;
+#endif
+}
+
+static int processx__pidfd_send_signal(processx_handle_t *handle, int sig) {
+#ifdef PROCESSX__NR_PIDFD_SEND_SIGNAL
+  if (handle->pidfd >= 0) {
+    return (int) syscall(PROCESSX__NR_PIDFD_SEND_SIGNAL, handle->pidfd, sig,
+                         NULL, 0);
+  }
+#endif
+  return kill(handle->pid, sig);
+}
+
+extern processx__child_list_t **child_table;
+extern size_t child_table_size, child_table_count, child_table_used;
 extern processx__child_list_t child_free_list_head;
+extern SEXP child_registry;
+extern int *child_registry_free;
+extern int child_registry_nfree;
 extern processx__child_list_t *child_free_list;
 
 extern int processx__notify_old_sigchld_handler;
 
+/* Set PROCESSX_USE_FORK to use fork() instead of clone() */
+int processx__use_fork = 0;
+
 /* We are trying to make sure that the variables in the library are
    properly set to their initial values after a library (re)load.
    This function is called from `R_init_processx`. */
@@ -66,10 +121,11 @@ extern int processx__notify_old_sigchld_handler;
 void R_init_processx_unix(void) {
   processx__main_thread = pthread_self();
 
-  child_list_head.pid = 0;
-  child_list_head.weak_status = R_NilValue;
-  child_list_head.next = 0;
-  child_list = &child_list_head;
+  child_table = 0;
+  child_table_size = child_table_count = child_table_used = 0;
+  child_registry = NULL;
+  child_registry_free = 0;
+  child_registry_nfree = 0;
 
   child_free_list_head.pid = 0;
   child_free_list_head.weak_status = R_NilValue;
@@ -79,6 +135,8 @@ void R_init_processx_unix(void) {
   if (getenv("PROCESSX_NOTIFY_OLD_SIGCHLD")) {
     processx__notify_old_sigchld_handler = 1;
   }
+
+  processx__use_fork = getenv("PROCESSX_USE_FORK") != NULL;
 }
 
 int processx__pty_main_open(char *sub_name, size_t sn_len) {
@@ -121,213 +179,11 @@ int processx__pty_main_open(char *sub_name, size_t sn_len) {
   return main_fd;
 }
 
-/* These run in the child process, so no coverage here. */
-/* LCOV_EXCL_START */
-
-void processx__write_int(int fd, int err) {
-  ssize_t dummy = write(fd, &err, sizeof(int));
-  (void) dummy;
-}
-
-static void processx__child_init(processx_handle_t *handle, SEXP connections,
-                                 int (*pipes)[2], int stdio_count,
-                                 char *command, char **args,
-                                 int error_fd, const char *pty_name, char **env,
-                                 processx_options_t *options,
-                                 const char *tree_id) {
-
-  int close_fd, use_fd, fd, i;
-  int min_fd = 0;
-
-  setsid();
-
-  /* Do we need a pty? */
-  if (pty_name) {
-    /* Do not mess with stdin/stdout/stderr, all handled by the pty */
-    min_fd = 3;
-
-    int sub_fd = open(pty_name, O_RDWR);
-    if (sub_fd == -1) {
-      processx__write_int(error_fd, -errno);
-      raise(SIGKILL);
-    }
-
-#ifdef TIOCSCTTY
-    if (ioctl(sub_fd, TIOCSCTTY, 0) == -1) {
-      processx__write_int(error_fd, -errno);
-      raise(SIGKILL);
-    }
-#endif
-
-#ifdef TIOCSWINSZ
-    struct winsize w;
-    w.ws_row = options->pty_rows;
-    w.ws_col = options->pty_cols;
-    if (ioctl(sub_fd, TIOCSWINSZ, &w) == -1) {
-      processx__write_int(error_fd, -errno);
-      raise(SIGKILL);
-    }
-#endif
-
-    struct termios tp;
-
-    if (tcgetattr(sub_fd, &tp) == -1) {
-      processx__write_int(error_fd, -errno);
-      raise(SIGKILL);
-    }
-
-    if (options->pty_echo) {
-      tp.c_lflag |= ECHO;
-    } else {
-      tp.c_lflag &= ~ECHO;
-    }
-
-    if (tcsetattr(sub_fd, TCSAFLUSH, &tp) == -1) {
-      processx__write_int(error_fd, -errno);
-      raise(SIGKILL);
-    }
-
-    /* TODO: set other terminal attributes and size */
-
-    /* Duplicate pty sub to be child's stdin, stdout, and stderr */
-    if (dup2(sub_fd, STDIN_FILENO) != STDIN_FILENO) {
-      processx__write_int(error_fd, -errno);
-      raise(SIGKILL);
-    }
-    if (dup2(sub_fd, STDOUT_FILENO) != STDOUT_FILENO) {
-      processx__write_int(error_fd, -errno);
-      raise(SIGKILL);
-    }
-    if (dup2(sub_fd, STDERR_FILENO) != STDERR_FILENO) {
-      processx__write_int(error_fd, -errno);
-      raise(SIGKILL);
-    }
-
-    if (sub_fd > STDERR_FILENO) close(sub_fd);
-  }
-
-  /* We want to prevent use_fd < fd, because we will dup2() use_fd into
-     fd later. If use_fd >= fd, then this is always possible,
-     without mixing up stdin, stdout and stderr. Without this, we could
-     have a case when we dup2() 2 into 1, and then 1 is lost. */
-
-  for (fd = min_fd; fd < stdio_count; fd++) {
-    use_fd = pipes[fd][1];
-    /* If use_fd < 0 then there is no pipe for fd. */
-    if (use_fd < 0 || use_fd >= fd) continue;
-    /* If use_fd < fd, then we create a brand new fd for it,
-       starting at stdio_count, which is bigger then fd, surely. */
-    pipes[fd][1] = fcntl(use_fd, F_DUPFD, stdio_count);
-    if (pipes[fd][1] == -1) {
-      processx__write_int(error_fd, -errno);
-      raise(SIGKILL);
-    }
-  }
-
-  /* This loop initializes the stdin, stdout, stderr fds of the child
-     process properly. */
-
-  for (fd = min_fd; fd < stdio_count; fd++) {
-    SEXP output = VECTOR_ELT(connections, fd);
-    const char *stroutput =
-      Rf_isString(output) ? CHAR(STRING_ELT(output, 0)) : NULL;
-
-    /* close_fd is an fd that must be closed. Initially this is the
-       parent's end of a pipe. (-1 if no pipe for this fd.) */
-    close_fd = pipes[fd][0];
-    /* use_fd is the fd that the child must use for stdin/out/err. */
-    use_fd = pipes[fd][1];
-
-    /* If no pipe, then we see if this is the 2>&1 case. */
-    if (fd == 2 && use_fd < 0 && stroutput &&
-	! strcmp(stroutput, "2>&1")) {
-      use_fd = 1;
-
-    } else if (use_fd < 0) {
-      /* Otherwise we open a file. If the stdin/out/err is not
-	 requested, then we open a file to /dev/null */
-      /* For fd >= 3, the fd is just passed, and we just use it,
-	 no need to open any file */
-      if (fd >= 3) continue;
-
-      if (stroutput) {
-	/* A file was requested, open it */
-	if (fd == 0) {
-	  use_fd = open(stroutput, O_RDONLY);
-	} else {
-	  use_fd = open(stroutput, O_CREAT | O_TRUNC| O_RDWR, 0644);
-	}
-      } else {
-	/* NULL, so stdin/out/err is ignored, using /dev/null */
-	use_fd = open("/dev/null", fd == 0 ? O_RDONLY : O_RDWR);
-      }
-      /* In the output file case, we might need to close use_fd, after
-	 we dup2()-d it into fd. */
-      close_fd = use_fd;
-
-      if (use_fd == -1) {
-	processx__write_int(error_fd, -errno);
-	raise(SIGKILL);
-      }
-    }
-
-    /* We will use use_fd for fd. If they happen to be equal, make
-       sure that fd is _not_ closed on exec. Otherwise dup2() use_fd
-       into fd. dup2() clears the CLOEXEC flag, so no need for a fcntl
-       call in this case. */
-    if (fd == use_fd) {
-      processx__cloexec_fcntl(use_fd, 0);
-    } else {
-      fd = dup2(use_fd, fd);
-    }
-
-    if (fd == -1) {
-      processx__write_int(error_fd, -errno);
-      raise(SIGKILL);
-    }
-
-    if (fd <= 2) processx__nonblock_fcntl(fd, 0);
-
-    /* If we have an extra fd, that we already dup2()-d into fd,
-       we can close it now. */
-    if (close_fd >= stdio_count) close(close_fd);
-  }
-
-  for (fd = min_fd; fd < stdio_count; fd++) {
-    use_fd = pipes[fd][1];
-    if (use_fd >= stdio_count) close(use_fd);
-  }
-
-  for (i = stdio_count; i < error_fd; i++) {
-    close(i);
-  }
-  for (i = error_fd + 1; ; i++) {
-    if (-1 == close(i) && i > 200) break;
-  }
-
-  if (options->wd != NULL && chdir(options->wd)) {
-    processx__write_int(error_fd, - errno);
-    raise(SIGKILL);
-  }
-
-  if (env) environ = env;
-
-  if (putenv(strdup(tree_id))) {
-    processx__write_int(error_fd, - errno);
-    raise(SIGKILL);
-  }
-
-  execvp(command, args);
-  processx__write_int(error_fd, - errno);
-  raise(SIGKILL);
-}
-
-/* LCOV_EXCL_STOP */
-
 void processx__finalizer(SEXP status) {
   processx_handle_t *handle = (processx_handle_t*) R_ExternalPtrAddr(status);
   pid_t pid;
   int wp, wstat;
+  struct rusage ru;
 
   processx__block_sigchld();
 
@@ -342,19 +198,19 @@ void processx__finalizer(SEXP status) {
   if (handle->cleanup) {
     /* Do a non-blocking waitpid() to see if it is running */
     do {
-      wp = waitpid(pid, &wstat, WNOHANG);
+      wp = wait4(pid, &wstat, WNOHANG, &ru);
     } while (wp == -1 && errno == EINTR);
 
     /* Maybe just waited on it? Then collect status */
-    if (wp == pid) processx__collect_exit_status(status, wp, wstat);
+    if (wp == pid) processx__collect_exit_status(status, wp, wstat, &ru);
 
     /* If it is running, we need to kill it, and wait for the exit status */
     if (wp == 0) {
       kill(-pid, SIGKILL);
       do {
-	wp = waitpid(pid, &wstat, 0);
+	wp = wait4(pid, &wstat, 0, &ru);
       } while (wp == -1 && errno == EINTR);
-      processx__collect_exit_status(status, wp, wstat);
+      processx__collect_exit_status(status, wp, wstat, &ru);
     }
   }
 
@@ -377,7 +233,9 @@ static SEXP processx__make_handle(SEXP private, int cleanup) {
   handle = (processx_handle_t*) malloc(sizeof(processx_handle_t));
   if (!handle) { R_THROW_ERROR("Cannot make processx handle, out of memory"); }
   memset(handle, 0, sizeof(processx_handle_t));
-  handle->waitpipe[0] = handle->waitpipe[1] = -1;
+  handle->exec_fd = -1;
+  handle->pidfd = -1;
+  handle->exitpipe[0] = handle->exitpipe[1] = -1;
 
   result = PROTECT(R_MakeExternalPtr(handle, private, R_NilValue));
   R_RegisterCFinalizerEx(result, processx__finalizer, 1);
@@ -389,6 +247,10 @@ static SEXP processx__make_handle(SEXP private, int cleanup) {
 
 static void processx__handle_destroy(processx_handle_t *handle) {
   if (!handle) return;
+  if (handle->exec_fd >= 0) close(handle->exec_fd);
+  if (handle->pidfd >= 0) close(handle->pidfd);
+  if (handle->exitpipe[0] >= 0) close(handle->exitpipe[0]);
+  if (handle->exitpipe[1] >= 0) close(handle->exitpipe[1]);
   free(handle);
 }
 
@@ -425,62 +287,135 @@ skip:
   processx__cloexec_fcntl(pipe[1], 1);
 }
 
-SEXP processx_exec(SEXP command, SEXP args, SEXP pty, SEXP pty_options,
-                   SEXP connections, SEXP env, SEXP windows_verbatim_args,
-                   SEXP windows_hide_window, SEXP windows_detached_process,
-                   SEXP private, SEXP cleanup, SEXP wd, SEXP encoding,
-                   SEXP tree_id) {
+/* The environment of the child: the requested one, or ours, plus the
+   tree id. The tree id replaces a variable of the same name, if any. */
+
+static char **processx__child_env(char **env, const char *tree_id) {
+  char **src = env ? env : environ;
+  const char *eq = strchr(tree_id, '=');
+  size_t nlen = eq ? (size_t) (eq - tree_id) + 1 : strlen(tree_id);
+  size_t i, n = 0, j = 0;
+  char **res;
+
+  while (src[n]) n++;
+  res = (char**) R_alloc(n + 2, sizeof(char*));
+  for (i = 0; i < n; i++) {
+    if (!strncmp(src[i], tree_id, nlen)) continue;
+    res[j++] = src[i];
+  }
+  res[j++] = (char*) tree_id;
+  res[j] = NULL;
 
-  char *ccommand = processx__tmp_string(command, 0);
-  char **cargs = processx__tmp_character(args);
-  char **cenv = isNull(env) ? 0 : processx__tmp_character(env);
-  int ccleanup = INTEGER(cleanup)[0];
+  return res;
+}
 
-  const int cpty = LOGICAL(pty)[0];
-  const char *cencoding = CHAR(STRING_ELT(encoding, 0));
-  const char *ctree_id = CHAR(STRING_ELT(tree_id, 0));
-  processx_options_t options = { 0 };
-  int num_connections = LENGTH(connections);
+/* Start the child, it runs processx__child_init() until the exec.
+   Must be called with SIGCHLD blocked. With clone() we are suspended
+   until the exec, so for an `async` start we always use fork(). */
 
+static pid_t processx__spawn(processx__child_args_t *child, int async) {
   pid_t pid;
-  int err, exec_errorno = 0, status;
-  ssize_t r;
-  int signal_pipe[2] = { -1, -1 };
+
+#ifdef PROCESSX__USE_CLONE
+  if (!async && !processx__use_fork && !processx__clone_stack) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_STACK
+    flags |= MAP_STACK;
+#endif
+    void *stack = mmap(NULL, PROCESSX__CLONE_STACK_SIZE,
+                       PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (stack != MAP_FAILED) processx__clone_stack = stack;
+  }
+
+  if (!async && !processx__use_fork && processx__clone_stack) {
+    /* No signal handler may run in the child, until it has reset them,
+       so we block everything while cloning. The parent is suspended
+       until the child calls exec or exits. */
+    sigset_t all, old;
+    int err;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pid = clone(processx__child_start,
+                processx__clone_stack + PROCESSX__CLONE_STACK_SIZE,
+                CLONE_VM | CLONE_VFORK | SIGCHLD, child);
+    err = errno;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    errno = err;
+    return pid;
+  }
+#endif
+
+  pid = fork();
+  /* LCOV_EXCL_START */
+  if (pid == 0) processx__child_init(child);
+  /* LCOV_EXCL_STOP */
+  return pid;
+}
+
+/* A process that we are starting. processx_exec() starts a single one,
+   processx_exec_many() starts several ones at once. */
+
+#define R_PROCESSX_PTY_NAME_LEN 2014
+
+typedef struct processx__exec_s {
+  SEXP result;			/* the handle, protected by the caller */
+  processx_handle_t *handle;
+  const char *command;
+  int signal_pipe[2];
   int (*pipes)[2];
-  int i;
   int pty_main_fd;
-#define R_PROCESSX_PTY_NAME_LEN 2014
-  char pty_namex[R_PROCESSX_PTY_NAME_LEN];
-  char *pty_name = cpty ? pty_namex : 0;
+  char pty_name[R_PROCESSX_PTY_NAME_LEN];
+  pid_t pid;
+  processx__child_args_t child;
+} processx__exec_t;
 
-  processx_handle_t *handle = NULL;
-  SEXP result;
+/* Create the pipes and everything else the child needs, except for the
+   environment and the signal mask. */
+
+static void processx__exec_prepare(processx__exec_t *ex, SEXP result,
+                                   SEXP commands, int idx, SEXP args,
+                                   int cpty, SEXP pty_options,
+                                   SEXP connections, SEXP wd) {
+
+  char *ccommand = processx__tmp_string(commands, idx);
+  char **cargs = processx__tmp_character(args);
+  int num_connections = LENGTH(connections);
+  processx_handle_t *handle = R_ExternalPtrAddr(result);
+  processx__child_args_t *child = &ex->child;
+  int (*pipes)[2];
+  int i, nargs;
+
+  memset(ex, 0, sizeof(processx__exec_t));
+  ex->result = result;
+  ex->handle = handle;
+  ex->command = ccommand;
+  ex->signal_pipe[0] = ex->signal_pipe[1] = -1;
+  ex->pty_main_fd = -1;
 
-  pipes = (int(*)[2]) R_alloc(num_connections, sizeof(int) * 2);
+  pipes = ex->pipes = (int(*)[2]) R_alloc(num_connections, sizeof(int) * 2);
   for (i = 0; i < num_connections; i++) pipes[i][0] = pipes[i][1] = -1;
+  child->stdio_count = num_connections;
+  child->modes = (int*) R_alloc(num_connections, sizeof(int));
+  child->files = (const char**) R_alloc(num_connections, sizeof(char*));
 
-  options.wd = isNull(wd) ? 0 : CHAR(STRING_ELT(wd, 0));
+  child->wd = isNull(wd) ? 0 : CHAR(STRING_ELT(wd, 0));
 
-  if (pipe(signal_pipe)) {
+  if (pipe(ex->signal_pipe)) {
     R_THROW_SYSTEM_ERROR("Cannot create pipe when running '%s'", ccommand);
   }
-  processx__cloexec_fcntl(signal_pipe[0], 1);
-  processx__cloexec_fcntl(signal_pipe[1], 1);
-
-  processx__setup_sigchld();
-
-  result = PROTECT(processx__make_handle(private, ccleanup));
-  handle = R_ExternalPtrAddr(result);
+  processx__cloexec_fcntl(ex->signal_pipe[0], 1);
+  processx__cloexec_fcntl(ex->signal_pipe[1], 1);
 
   if (cpty) {
-    pty_main_fd =
-      processx__pty_main_open(pty_name, R_PROCESSX_PTY_NAME_LEN);
-    if (pty_main_fd == -1) {
+    ex->pty_main_fd =
+      processx__pty_main_open(ex->pty_name, R_PROCESSX_PTY_NAME_LEN);
+    if (ex->pty_main_fd == -1) {
       R_THROW_SYSTEM_ERROR("Cannot open pty when running '%s'", ccommand);
     }
-    options.pty_echo = LOGICAL(VECTOR_ELT(pty_options, 0))[0];
-    options.pty_rows = INTEGER(VECTOR_ELT(pty_options, 1))[0];
-    options.pty_cols = INTEGER(VECTOR_ELT(pty_options, 2))[0];
+    child->pty_name = ex->pty_name;
+    child->pty_echo = LOGICAL(VECTOR_ELT(pty_options, 0))[0];
+    child->pty_rows = INTEGER(VECTOR_ELT(pty_options, 1))[0];
+    child->pty_cols = INTEGER(VECTOR_ELT(pty_options, 2))[0];
   }
 
   handle->fd0 = handle->fd1 = handle->fd2 = -1;
@@ -489,6 +424,9 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP pty, SEXP pty_options,
     const char *stroutput =
       Rf_isString(output) ? CHAR(STRING_ELT(output, 0)) : NULL;
 
+    child->files[i] = NULL;
+    child->modes[i] = i < 3 ? PROCESSX__CHILD_NULL : PROCESSX__CHILD_SKIP;
+
     if (isNull(output)) {
       /* Ignored output, nothing to do, handled in the child */
 
@@ -499,16 +437,23 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP pty, SEXP pty_options,
       if (i == 1) handle->fd1 = pipes[i][0];
       if (i == 2) handle->fd2 = pipes[i][0];
       processx__nonblock_fcntl(pipes[i][0], 1);
+      child->modes[i] = PROCESSX__CHILD_FD;
 
     } else if (i == 2 && stroutput && ! strcmp("2>&1", stroutput)) {
       /* redirected stderr, handled in child */
+      child->modes[i] = PROCESSX__CHILD_STDOUT;
 
     } else if (stroutput && ! strcmp("", stroutput)) {
       /* inherited std stream, assume usual numbers */
       pipes[i][1] = i;
+      child->modes[i] = PROCESSX__CHILD_FD;
 
     } else if (stroutput) {
       /* redirect to file, nothing to do the child will open it */
+      if (i < 3) {
+        child->files[i] = stroutput;
+        child->modes[i] = PROCESSX__CHILD_FILE;
+      }
 
     } else {
       /* inherited processx connection, need to duplicate */
@@ -516,65 +461,185 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP pty, SEXP pty_options,
 	R_ExternalPtrAddr(VECTOR_ELT(connections, i));
       int fd = processx_c_connection_fileno(ccon);
       pipes[i][1] = fd;
+      child->modes[i] = PROCESSX__CHILD_FD;
     }
   }
 
-  processx__block_sigchld();
+  /* Everything the child needs, it must not allocate memory */
+  child->command = ccommand;
+  child->args = cargs;
+  for (nargs = 0; cargs[nargs]; nargs++) ;
+  child->sh_args = (char**) R_alloc(nargs + 2, sizeof(char*));
+  child->sh_args[0] = "/bin/sh";
+  for (i = 1; i <= nargs; i++) child->sh_args[i + 1] = cargs[i];
+  child->fds = (int*) R_alloc(num_connections, sizeof(int));
+  for (i = 0; i < num_connections; i++) child->fds[i] = pipes[i][1];
+  child->error_fd = ex->signal_pipe[1];
+  child->max_fd = processx__child_max_fd();
+  child->pty_main_fd = ex->pty_main_fd;
+}
 
-  pid = fork();
+/* Close the fds of a process that we could not start */
 
-  /* TODO: how could we test a failure? */
-  if (pid == -1) {		/* ERROR */
-    err = -errno;
-    if (signal_pipe[0] >= 0) close(signal_pipe[0]);
-    if (signal_pipe[1] >= 0) close(signal_pipe[1]);
-    if (cpty) close(pty_main_fd);
-    processx__unblock_sigchld();
-    R_THROW_SYSTEM_ERROR_CODE(err, "Cannot fork when running '%s'",
-                              ccommand);
+static void processx__exec_abort(processx__exec_t *ex) {
+  int i;
+  if (ex->signal_pipe[0] >= 0) close(ex->signal_pipe[0]);
+  if (ex->signal_pipe[1] >= 0) close(ex->signal_pipe[1]);
+  ex->signal_pipe[0] = ex->signal_pipe[1] = -1;
+  if (ex->pty_main_fd >= 0) close(ex->pty_main_fd);
+  ex->pty_main_fd = -1;
+  for (i = 0; i < 3 && i < ex->child.stdio_count; i++) {
+    if (ex->pipes[i][0] >= 0) {
+      close(ex->pipes[i][0]);
+      close(ex->pipes[i][1]);
+    }
   }
+}
 
-  /* CHILD */
-  if (pid == 0) {
-    /* LCOV_EXCL_START */
-    if (cpty) close(pty_main_fd);
-    processx__unblock_sigchld();
-    processx__child_init(handle, connections, pipes, num_connections,
-			 ccommand, cargs, signal_pipe[1],
-                         pty_name, cenv, &options, ctree_id);
-    R_THROW_SYSTEM_ERROR("Cannot start child process when running '%s'",
-                         ccommand);
-    /* LCOV_EXCL_STOP */
+/* Kill and reap a child that we started, but will not return to R */
+
+static void processx__exec_kill(processx__exec_t *ex, SEXP status,
+                                pid_t pid) {
+  int wp, wstat;
+  if (pid <= 0 || ex->handle->collected) return;
+  kill(pid, SIGKILL);
+  do {
+    wp = waitpid(pid, &wstat, 0);
+  } while (wp == -1 && errno == EINTR);
+  processx__collect_exit_status(status, wp, wstat, NULL);
+}
+
+/* If processx_exec_many() throws, then this cleans up after it. If
+   processx__exec_prepare() threw, then it closes the fds of the
+   processes that were prepared already, including the one that failed.
+   If we started some processes already, then it kills them, because
+   they do not have an R object. The first `finished` ones went through
+   processx__exec_finish(), their fds belong to their connections. */
+
+typedef struct processx__exec_many_s {
+  processx__exec_t *ex;
+  SEXP result;
+  int prepared;
+  int started;
+  int finished;
+} processx__exec_many_t;
+
+static void processx__exec_many_cleanup(void *data) {
+  processx__exec_many_t *many = data;
+  sigset_t set, old;
+  int i;
+
+  for (i = 0; i < many->prepared; i++) processx__exec_abort(&many->ex[i]);
+
+  /* This must not throw, so no processx__block_sigchld() here */
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &set, &old);
+  for (i = 0; i < many->started; i++) {
+    processx__exec_t *ex = &many->ex[i];
+    SEXP status = VECTOR_ELT(many->result, i);
+    if (i < many->finished) {
+      /* handle->pid is zero if the exec() failed, it is reaped already */
+      processx__exec_kill(ex, status, ex->handle->pid);
+    } else {
+      processx__exec_kill(ex, status, ex->pid);
+      processx__exec_abort(ex);
+    }
+  }
+  sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+#define PROCESSX__SPAWN_OK    0
+#define PROCESSX__SPAWN_FORK  1
+#define PROCESSX__SPAWN_NOMEM 2
+
+/* Must be called with SIGCHLD blocked. Does not throw errors, because
+   it might not be safe to unblock SIGCHLD, yet. On a fork error `*err`
+   is set to the (negative) errno value. */
+
+static int processx__exec_spawn(processx__exec_t *ex, int async, int *err) {
+  pid_t pid;
+
+  ex->handle->spawn_ns = processx__now_ns();
+
+  /* Use the fork server if it is running, otherwise start it here. The
+     fork server only replies after the exec, so not for `async`. */
+  pid = async ? -2 : processx__forkserver_spawn(&ex->child);
+  if (pid == -2) pid = processx__spawn(&ex->child, async);
+
+  /* TODO: how could we test a failure? */
+  if (pid == -1) {
+    *err = -errno;
+    processx__exec_abort(ex);
+    return PROCESSX__SPAWN_FORK;
   }
 
   /* Query creation time ASAP. We'll use (pid, create_time) as an ID,
      to avoid race conditions when sending signals */
-  handle->create_time = processx__create_time(pid);
+  ex->handle->create_time = processx__create_time(pid);
 
-  handle->ptyfd = -1;
-  if (cpty) handle->ptyfd = pty_main_fd;
+  ex->handle->ptyfd = ex->pty_main_fd;
 
-  /* We need to know the processx children */
-  if (processx__child_add(pid, result)) {
-    err = -errno;
-    if (signal_pipe[0] >= 0) close(signal_pipe[0]);
-    if (signal_pipe[1] >= 0) close(signal_pipe[1]);
-    processx__unblock_sigchld();
-    R_THROW_ERROR("Cannot create child process '%s', out of memory",
-                  ccommand);
+  /* SIGCHLD is blocked, so the child cannot be reaped yet */
+  ex->handle->pidfd = processx__pidfd_open(pid);
+
+  /* We need to know the processx children. If we cannot track it,
+     then the child must go, it is not in the table, so we reap it. */
+  if (processx__child_add(pid, ex->result)) {
+    int wp, wstat;
+    *err = -errno;
+    kill(pid, SIGKILL);
+    do {
+      wp = waitpid(pid, &wstat, 0);
+    } while (wp == -1 && errno == EINTR);
+    if (ex->handle->pidfd >= 0) close(ex->handle->pidfd);
+    ex->handle->pidfd = -1;
+    ex->handle->ptyfd = -1;
+    processx__exec_abort(ex);
+    return PROCESSX__SPAWN_NOMEM;
   }
 
-  /* SIGCHLD can arrive now */
-  processx__unblock_sigchld();
+  ex->pid = pid;
+  return PROCESSX__SPAWN_OK;
+}
 
-  if (signal_pipe[1] >= 0) close(signal_pipe[1]);
+/* Close the child's ends of the std pipes, and create the connections */
+
+static void processx__exec_connections(processx__exec_t *ex, SEXP private,
+                                       const char *encoding) {
+  int i;
+
+  /* Closed unused ends of std pipes. If there is no parent end, then
+     this is an inherited std{in,out,err} fd, so we should not close it. */
+  for (i = 0; i < 3; i++) {
+    if (ex->pipes[i][1] >= 0 && ex->pipes[i][0] >= 0) {
+      close(ex->pipes[i][1]);
+    }
+  }
+
+  /* Create proper connections */
+  processx__create_connections(ex->handle, private, encoding);
+}
+
+/* Wait for the exec() in the child and create the connections. Returns
+   zero, or the (negative) errno value if the exec failed. */
+
+static int processx__exec_finish(processx__exec_t *ex, SEXP private,
+                                 const char *encoding) {
+  int err, exec_errorno = 0, status;
+  ssize_t r;
+  pid_t pid = ex->pid;
+
+  if (ex->signal_pipe[1] >= 0) close(ex->signal_pipe[1]);
+  ex->signal_pipe[1] = -1;
 
   do {
-    r = read(signal_pipe[0], &exec_errorno, sizeof(exec_errorno));
+    r = read(ex->signal_pipe[0], &exec_errorno, sizeof(exec_errorno));
   } while (r == -1 && errno == EINTR);
 
   if (r == 0) {
-    ; /* okay, EOF */
+    /* okay, EOF */
+    ex->handle->exec_ns = processx__now_ns();
   } else if (r == sizeof(exec_errorno)) {
     do {
       err = waitpid(pid, &status, 0); /* okay, read errorno */
@@ -588,33 +653,212 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP pty, SEXP pty_options,
   } else {
     R_THROW_SYSTEM_ERROR_CODE(-exec_errorno,
                               "Child process '%s' failed to start",
-                              ccommand);
+                              ex->command);
   }
 
-  if (signal_pipe[0] >= 0) close(signal_pipe[0]);
+  if (ex->signal_pipe[0] >= 0) close(ex->signal_pipe[0]);
+  ex->signal_pipe[0] = -1;
 
-  /* Closed unused ends of std pipes. If there is no parent end, then
-     this is an inherited std{in,out,err} fd, so we should not close it. */
-  for (i = 0; i < 3; i++) {
-    if (pipes[i][1] >= 0 && pipes[i][0] >= 0) close(pipes[i][1]);
+  processx__exec_connections(ex, private, encoding);
+
+  if (exec_errorno == 0) ex->handle->pid = pid;
+
+  return exec_errorno;
+}
+
+/* Same, but do not wait for the exec() in the child. The read end of the
+   exec status pipe is kept in the handle, see processx_start_status(). */
+
+static void processx__exec_finish_async(processx__exec_t *ex, SEXP private,
+                                        const char *encoding) {
+
+  if (ex->signal_pipe[1] >= 0) close(ex->signal_pipe[1]);
+  ex->signal_pipe[1] = -1;
+
+  processx__nonblock_fcntl(ex->signal_pipe[0], 1);
+  ex->handle->exec_fd = ex->signal_pipe[0];
+  ex->signal_pipe[0] = -1;
+
+  processx__exec_connections(ex, private, encoding);
+
+  ex->handle->pid = ex->pid;
+}
+
+SEXP processx_exec(SEXP command, SEXP args, SEXP pty, SEXP pty_options,
+                   SEXP connections, SEXP env, SEXP windows_verbatim_args,
+                   SEXP windows_hide_window, SEXP windows_detached_process,
+                   SEXP private, SEXP cleanup, SEXP wd, SEXP encoding,
+                   SEXP tree_id, SEXP async) {
+
+  char **cenv = isNull(env) ? 0 : processx__tmp_character(env);
+  int ccleanup = INTEGER(cleanup)[0];
+  const int cpty = LOGICAL(pty)[0];
+  const char *cencoding = CHAR(STRING_ELT(encoding, 0));
+  const char *ctree_id = CHAR(STRING_ELT(tree_id, 0));
+  const int casync = LOGICAL(async)[0];
+  processx__exec_t *ex;
+  int ret, err = 0, exec_errorno;
+  SEXP result;
+
+  ex = (processx__exec_t*) R_alloc(1, sizeof(processx__exec_t));
+
+  processx__setup_sigchld();
+
+  result = PROTECT(processx__make_handle(private, ccleanup));
+  processx__exec_prepare(ex, result, command, 0, args, cpty, pty_options,
+                         connections, wd);
+  ex->child.env = processx__child_env(cenv, ctree_id);
+  ex->child.path = processx__child_path(ex->child.env);
+
+  processx__block_sigchld();
+
+  /* The child restores our signal mask, but with SIGCHLD unblocked */
+  sigprocmask(SIG_SETMASK, NULL, &ex->child.sigmask);
+  sigdelset(&ex->child.sigmask, SIGCHLD);
+
+  ret = processx__exec_spawn(ex, casync, &err);
+
+  /* SIGCHLD can arrive now */
+  processx__unblock_sigchld();
+
+  if (ret == PROCESSX__SPAWN_FORK) {
+    R_THROW_SYSTEM_ERROR_CODE(err, "Cannot fork when running '%s'",
+                              ex->command);
+  } else if (ret == PROCESSX__SPAWN_NOMEM) {
+    R_THROW_ERROR("Cannot create child process '%s', out of memory",
+                  ex->command);
   }
 
-  /* Create proper connections */
-  processx__create_connections(handle, private, cencoding);
+  if (casync) {
+    processx__exec_finish_async(ex, private, cencoding);
+    UNPROTECT(1);		/* result */
+    return result;
+  }
+
+  exec_errorno = processx__exec_finish(ex, private, cencoding);
 
   if (exec_errorno == 0) {
-    handle->pid = pid;
     UNPROTECT(1);		/* result */
     return result;
   }
 
   R_THROW_SYSTEM_ERROR_CODE(-exec_errorno,
                             "cannot start processx process '%s'",
-                            ccommand);
+                            ex->command);
   return R_NilValue;
 }
 
-void processx__collect_exit_status(SEXP status, int retval, int wstat) {
+/* Start several processes at once, with the same options. The
+   environment is built once, because only the tree id differs, and that
+   is always its last entry. We start all processes first, and only then
+   wait for their exec() calls. */
+
+SEXP processx_exec_many(SEXP commands, SEXP args, SEXP connections,
+                        SEXP env, SEXP privates, SEXP cleanup, SEXP wd,
+                        SEXP encoding, SEXP tree_ids) {
+
+  int i, n = LENGTH(commands);
+  char **cenv = isNull(env) ? 0 : processx__tmp_character(env);
+  int ccleanup = INTEGER(cleanup)[0];
+  const char *cencoding = CHAR(STRING_ELT(encoding, 0));
+  processx__exec_t *ex;
+  processx__exec_many_t many = { NULL, R_NilValue, 0, 0, 0 };
+  char **env_block;
+  const char *path;
+  size_t env_last;
+  sigset_t sigmask;
+  int started = 0, ret = PROCESSX__SPAWN_OK, err = 0;
+  int failed = -1, exec_errorno = 0, this_errorno;
+  SEXP result;
+
+  if (n == 0) return allocVector(VECSXP, 0);
+
+  ex = (processx__exec_t*) R_alloc(n, sizeof(processx__exec_t));
+  many.ex = ex;
+  r_call_on_early_exit(processx__exec_many_cleanup, &many);
+
+  processx__setup_sigchld();
+
+  result = PROTECT(allocVector(VECSXP, n));
+  many.result = result;
+  for (i = 0; i < n; i++) {
+    SEXP handle = processx__make_handle(VECTOR_ELT(privates, i), ccleanup);
+    SET_VECTOR_ELT(result, i, handle);
+    ex[i].signal_pipe[0] = ex[i].signal_pipe[1] = -1;
+    ex[i].pty_main_fd = -1;
+    ex[i].child.stdio_count = 0;
+    many.prepared = i + 1;
+    processx__exec_prepare(&ex[i], handle, commands, i,
+                           VECTOR_ELT(args, i), 0, R_NilValue,
+                           VECTOR_ELT(connections, i), wd);
+  }
+
+  env_block = processx__child_env(cenv, CHAR(STRING_ELT(tree_ids, 0)));
+  for (env_last = 0; env_block[env_last]; env_last++) ;
+  env_last--;
+  path = processx__child_path(env_block);
+
+  /* From here on we close the fds ourselves */
+  many.prepared = 0;
+
+  processx__block_sigchld();
+
+  /* The child restores our signal mask, but with SIGCHLD unblocked */
+  sigprocmask(SIG_SETMASK, NULL, &sigmask);
+  sigdelset(&sigmask, SIGCHLD);
+
+  /* The children do not need `env_block` after processx__exec_spawn()
+     returns: they are either exec()-d already (clone), or they have a
+     copy (fork, fork server). So we can reuse it. */
+  for (started = 0; started < n; started++) {
+    env_block[env_last] = (char*) CHAR(STRING_ELT(tree_ids, started));
+    ex[started].child.env = env_block;
+    ex[started].child.path = path;
+    ex[started].child.sigmask = sigmask;
+    ret = processx__exec_spawn(&ex[started], 0, &err);
+    if (ret != PROCESSX__SPAWN_OK) break;
+  }
+  many.started = started;
+
+  /* SIGCHLD can arrive now */
+  processx__unblock_sigchld();
+
+  for (i = started + 1; i < n; i++) processx__exec_abort(&ex[i]);
+
+  /* If this throws, then the cleanup kills the started processes */
+  for (i = 0; i < started; i++) {
+    this_errorno = processx__exec_finish(&ex[i], VECTOR_ELT(privates, i),
+                                         cencoding);
+    many.finished = i + 1;
+    if (this_errorno != 0 && failed == -1) {
+      failed = i;
+      exec_errorno = this_errorno;
+    }
+  }
+
+  if (ret == PROCESSX__SPAWN_FORK) {
+    R_THROW_SYSTEM_ERROR_CODE(err, "Cannot fork when running '%s'",
+                              ex[started].command);
+  } else if (ret == PROCESSX__SPAWN_NOMEM) {
+    R_THROW_ERROR("Cannot create child process '%s', out of memory",
+                  ex[started].command);
+  }
+
+  if (failed != -1) {
+    R_THROW_SYSTEM_ERROR_CODE(-exec_errorno,
+                              "cannot start processx process '%s'",
+                              ex[failed].command);
+  }
+
+  /* Success, the processes belong to R now */
+  many.started = 0;
+
+  UNPROTECT(1);
+  return result;
+}
+
+void processx__collect_exit_status(SEXP status, int retval, int wstat,
+				   const struct rusage *rusage) {
   processx_handle_t *handle = R_ExternalPtrAddr(status);
 
   /* This must be called from a function that blocks SIGCHLD.
@@ -636,15 +880,23 @@ void processx__collect_exit_status(SEXP status, int retval, int wstat) {
     handle->exitcode = - WTERMSIG(wstat);
   }
 
+  /* We get the resource usage for free from wait4(), keep it */
+  if (retval != -1 && rusage) {
+    handle->rusage = *rusage;
+    handle->has_rusage = 1;
+  }
+  if (retval != -1) handle->reap_ns = processx__now_ns();
+
   handle->collected = 1;
-}
 
-static void processx__wait_cleanup(void *ptr) {
-  int *fds = (int*) ptr;
-  if (!fds) return;
-  if (fds[0] >= 0) close(fds[0]);
-  if (fds[1] >= 0) close(fds[1]);
-  free(fds);
+  /* Every reap comes here, not only the ones in the SIGCHLD handler, so
+     this is where the child leaves the child table, and where we wake
+     up the waits and polls on the exit pipe. */
+  processx__child_forget(handle->pid, status);
+  if (handle->exitpipe[1] >= 0) {
+    close(handle->exitpipe[1]);
+    handle->exitpipe[1] = -1;
+  }
 }
 
 /* In general we need to worry about three asynchronous processes here:
@@ -653,23 +905,24 @@ static void processx__wait_cleanup(void *ptr) {
  *    A good strategy is to avoid calling R functions here completely.
  *    Functions that return immediately, like `R_CheckUserInterrupt`, or
  *    a `ScalarLogical` that we return, are fine.
- * 3. The SIGCHLD handler that we just block at the beginning, but it can
- *    still be called between the R function doing the `.Call` to us, and
- *    the signal blocking call.
+ * 3. The SIGCHLD handler, that can be called at any time.
  *
  * Keeping these in mind, we do this:
  *
  * 1. If the exit status was copied over to R already, we return
  *    immediately from R. Otherwise this C function is called.
- * 2. We block SIGCHLD.
- * 3. If we already collected the exit status, then this process has
+ * 2. If we already collected the exit status, then this process has
  *    finished, so we don't need to wait.
- * 4. We set up a self-pipe that we can poll. The pipe will be closed in
- *    the SIGCHLD signal handler, and that triggers the poll event.
- * 5. We unblock the SIGCHLD handler, so that it can trigger the pipe event.
- * 6. We start polling. We poll in small time chunks, to keep the wait still
+ * 3. We get the exit fd of the process, see processx__exit_fd(). This is
+ *    the pidfd, or a pipe that the SIGCHLD handler closes. It is only
+ *    created once, with SIGCHLD blocked, and then it stays open until the
+ *    handle is destroyed, so we do not need to block SIGCHLD if it exists
+ *    already.
+ * 4. We start polling. We poll in small time chunks, to keep the wait still
  *    interruptible.
- * 7. We keep polling until the timeout expires or the process finishes.
+ * 5. We keep polling until the timeout expires or the process finishes.
+ *
+ * So waiting on a running process with a zero timeout is a single poll.
  */
 
 SEXP processx_wait(SEXP status, SEXP timeout, SEXP name) {
@@ -680,48 +933,29 @@ SEXP processx_wait(SEXP status, SEXP timeout, SEXP name) {
   int ret = 0;
   pid_t pid;
 
-  int *fds = malloc(sizeof(int) * 2);
-  if (!fds) R_THROW_SYSTEM_ERROR("Allocating memory when waiting");
-  fds[0] = fds[1] = -1;
-  r_call_on_exit(processx__wait_cleanup, fds);
-
-  processx__block_sigchld();
-
-  if (!handle) {
-    processx__unblock_sigchld();
-    return ScalarLogical(1);
-  }
-
-  pid = handle->pid;
-
   /* If we already have the status, then return now. */
-  if (handle->collected) {
-    processx__unblock_sigchld();
-    return ScalarLogical(1);
-  }
+  if (!handle || handle->collected) return ScalarLogical(1);
 
-  /* Make sure this is active, in case another package replaced it... */
-  processx__setup_sigchld();
-  processx__block_sigchld();
-
-  /* Setup the self-pipe that we can poll */
-  if (pipe(handle->waitpipe)) {
-    processx__unblock_sigchld();
-    R_THROW_SYSTEM_ERROR("processx error when waiting for '%s'", cname);
-  }
-  fds[0] = handle->waitpipe[0];
-  fds[1] = handle->waitpipe[1];
-  processx__nonblock_fcntl(handle->waitpipe[0], 1);
-  processx__nonblock_fcntl(handle->waitpipe[1], 1);
+  pid = handle->pid;
 
-  /* Poll on the pipe, need to unblock sigchld before */
-  fd.fd = handle->waitpipe[0];
+  fd.fd = handle->pidfd >= 0 ? handle->pidfd : handle->exitpipe[0];
   fd.events = POLLIN;
   fd.revents = 0;
 
-  processx__unblock_sigchld();
-
-
+  if (fd.fd < 0 || ctimeout != 0) {
+    processx__block_sigchld();
+    /* Make sure this is active, in case another package replaced it... */
+    processx__setup_sigchld();
+    if (handle->collected) {
+      processx__unblock_sigchld();
+      return ScalarLogical(1);
+    }
+    fd.fd = processx__exit_fd(handle);
+    processx__unblock_sigchld();
+    if (fd.fd < 0) {
+      R_THROW_SYSTEM_ERROR("processx error when waiting for '%s'", cname);
+    }
+  }
 
   while (ctimeout < 0 || timeleft > PROCESSX_INTERRUPT_INTERVAL) {
     do {
@@ -759,13 +993,119 @@ SEXP processx_wait(SEXP status, SEXP timeout, SEXP name) {
   }
 
  cleanup:
-  /* pipe is closed in the on_exit handler */
-  handle->waitpipe[0] = -1;
-  handle->waitpipe[1] = -1;
-
   return ScalarLogical(ret != 0);
 }
 
+/* Check whether an asynchronously started process has exec()-d already.
+   Returns 1 if it has, 0 if we don't know yet, and -errno if the exec()
+   failed. Processes started synchronously always return 1. */
+
+static int processx__start_status(processx_handle_t *handle) {
+  int exec_errorno = 0;
+  ssize_t r;
+
+  if (handle->exec_fd < 0) {
+    return handle->exec_errno ? handle->exec_errno : 1;
+  }
+
+  do {
+    r = read(handle->exec_fd, &exec_errorno, sizeof(exec_errorno));
+  } while (r == -1 && errno == EINTR);
+
+  if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+
+  if (r == 0) {
+    /* This is when we noticed the exec(), it might be late */
+    handle->exec_ns = processx__now_ns();
+  } else if (r == sizeof(exec_errorno)) {
+    /* The child exits with 127, the SIGCHLD handler will collect it */
+    handle->exec_errno = exec_errorno;
+  } else if (r == -1 && errno != EPIPE) {
+    handle->exec_errno = -errno;
+  }
+
+  close(handle->exec_fd);
+  handle->exec_fd = -1;
+
+  return handle->exec_errno ? handle->exec_errno : 1;
+}
+
+SEXP processx_start_status(SEXP status, SEXP name) {
+  processx_handle_t *handle = R_ExternalPtrAddr(status);
+  const char *cname = isNull(name) ? "???" : CHAR(STRING_ELT(name, 0));
+  int ret;
+
+  if (!handle) return ScalarLogical(1);
+
+  ret = processx__start_status(handle);
+  if (ret < 0) {
+    R_THROW_SYSTEM_ERROR_CODE(-ret, "cannot start processx process '%s'",
+                              cname);
+  }
+
+  return ScalarLogical(ret);
+}
+
+/* An fd that is readable once the process has exited: the pidfd if we
+   have one, otherwise the read end of a pipe, whose write end the SIGCHLD
+   handler closes. It stays open until the handle is destroyed, so it can
+   be polled any number of times. Must be called with SIGCHLD blocked.
+   Returns -1 if the exit status is already known, or on error. */
+
+int processx__exit_fd(processx_handle_t *handle) {
+  if (handle->pidfd >= 0) return handle->pidfd;
+  if (handle->exitpipe[0] >= 0) return handle->exitpipe[0];
+  if (handle->collected) return -1;
+  if (pipe(handle->exitpipe)) return -1;
+  processx__cloexec_fcntl(handle->exitpipe[0], 1);
+  processx__cloexec_fcntl(handle->exitpipe[1], 1);
+  processx__nonblock_fcntl(handle->exitpipe[0], 1);
+  processx__nonblock_fcntl(handle->exitpipe[1], 1);
+  return handle->exitpipe[0];
+}
+
+int processx_i_pre_poll_func_exit(processx_pollable_t *pollable) {
+  processx_handle_t *handle = pollable->object;
+  int fd;
+  if (!handle) return PXCLOSED;
+  processx__block_sigchld();
+  fd = handle->collected ? -1 : processx__exit_fd(handle);
+  processx__unblock_sigchld();
+  if (fd == -1) {
+    if (handle->collected) return PXEXIT;
+    R_THROW_SYSTEM_ERROR("Cannot poll for the exit of process %d",
+                         (int) handle->pid);
+  }
+  pollable->handle = fd;
+  return PXHANDLE;
+}
+
+int processx_c_pollable_from_exit(processx_pollable_t *pollable,
+                                  processx_handle_t *handle) {
+  pollable->pre_poll_func = processx_i_pre_poll_func_exit;
+  pollable->object = handle;
+  pollable->free = 0;
+  pollable->fds = R_NilValue;
+  return 0;
+}
+
+static int processx__pre_poll_func_start(processx_pollable_t *pollable) {
+  processx_handle_t *handle = pollable->object;
+  if (!handle) return PXCLOSED;
+  if (handle->exec_fd < 0) return PXREADY;
+  pollable->handle = handle->exec_fd;
+  return PXHANDLE;
+}
+
+int processx_c_pollable_from_start(processx_pollable_t *pollable,
+                                   processx_handle_t *handle) {
+  pollable->pre_poll_func = processx__pre_poll_func_start;
+  pollable->object = handle;
+  pollable->free = 0;
+  pollable->fds = R_NilValue;
+  return 0;
+}
+
 /* This is similar to `processx_wait`, but a bit simpler, because we
  * don't need to wait and poll. The same restrictions listed there, also
  * apply here.
@@ -786,6 +1126,7 @@ SEXP processx_is_alive(SEXP status, SEXP name) {
   const char *cname = isNull(name) ? "???" : CHAR(STRING_ELT(name, 0));
   pid_t pid;
   int wstat, wp;
+  struct rusage ru;
   int ret = 0;
 
   processx__block_sigchld();
@@ -796,13 +1137,13 @@ SEXP processx_is_alive(SEXP status, SEXP name) {
   /* Otherwise a non-blocking waitpid to collect zombies */
   pid = handle->pid;
   do {
-    wp = waitpid(pid, &wstat, WNOHANG);
+    wp = wait4(pid, &wstat, WNOHANG, &ru);
   } while (wp == -1 && errno == EINTR);
 
   /* Maybe another SIGCHLD handler collected the exit status?
      Then we just set it to NA (in the collect_exit_status call) */
   if (wp == -1 && errno == ECHILD) {
-    processx__collect_exit_status(status, wp, wstat);
+    processx__collect_exit_status(status, wp, wstat, &ru);
     goto cleanup;
   }
 
@@ -816,7 +1157,7 @@ SEXP processx_is_alive(SEXP status, SEXP name) {
   if (wp == 0) {
     ret = 1;
   } else {
-    processx__collect_exit_status(status, wp, wstat);
+    processx__collect_exit_status(status, wp, wstat, &ru);
   }
 
  cleanup:
@@ -824,6 +1165,79 @@ SEXP processx_is_alive(SEXP status, SEXP name) {
   return ScalarLogical(ret);
 }
 
+/* Wait until any or all of several processes exit. We poll the exit fds
+   of all running processes at once, see processx__exit_fd(). Returns the
+   (one-based) indices of the processes that have exited. */
+
+SEXP processx_wait_many(SEXP statuses, SEXP all, SEXP timeout) {
+  int i, k, n = LENGTH(statuses);
+  int call = LOGICAL(all)[0];
+  int ctimeout = INTEGER(timeout)[0];
+  int *done = (int*) R_alloc(n, sizeof(int));
+  int *fdidx = (int*) R_alloc(n, sizeof(int));
+  struct pollfd *fds = (struct pollfd*) R_alloc(n, sizeof(struct pollfd));
+  int ndone = 0, nfds, ret;
+  int64_t start = processx__now_ns();
+  SEXP result;
+
+  processx__block_sigchld();
+  /* Make sure this is active, in case another package replaced it... */
+  processx__setup_sigchld();
+  for (i = 0; i < n; i++) {
+    processx_handle_t *handle = R_ExternalPtrAddr(VECTOR_ELT(statuses, i));
+    done[i] = !handle || handle->collected;
+    if (done[i]) {
+      ndone++;
+    } else if (processx__exit_fd(handle) == -1) {
+      processx__unblock_sigchld();
+      R_THROW_SYSTEM_ERROR("processx error when waiting for process %d",
+                           (int) handle->pid);
+    }
+  }
+  processx__unblock_sigchld();
+
+  while (ndone < n && (call || ndone == 0)) {
+    int timeleft = -1;
+    if (ctimeout >= 0) {
+      timeleft = ctimeout - (int) ((processx__now_ns() - start) / 1000000);
+      if (timeleft < 0) timeleft = 0;
+    }
+
+    for (i = 0, nfds = 0; i < n; i++) {
+      processx_handle_t *handle;
+      if (done[i]) continue;
+      handle = R_ExternalPtrAddr(VECTOR_ELT(statuses, i));
+      fds[nfds].fd = handle->pidfd >= 0 ? handle->pidfd : handle->exitpipe[0];
+      fds[nfds].events = POLLIN;
+      fds[nfds].revents = 0;
+      fdidx[nfds++] = i;
+    }
+
+    ret = processx__interruptible_poll(fds, (nfds_t) nfds, timeleft);
+    if (ret == -1) {
+      R_THROW_SYSTEM_ERROR("processx error when waiting for processes");
+    }
+
+    /* Timeout */
+    if (ret == 0) break;
+
+    for (k = 0; k < nfds; k++) {
+      if (fds[k].revents) {
+        done[fdidx[k]] = 1;
+        ndone++;
+      }
+    }
+  }
+
+  result = PROTECT(allocVector(INTSXP, ndone));
+  for (i = 0, k = 0; i < n; i++) {
+    if (done[i]) INTEGER(result)[k++] = i + 1;
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
 /* This is essentially the same as `processx_is_alive`, but we return an
  * exit status if the process has already finished. See above.
  */
@@ -833,6 +1247,7 @@ SEXP processx_get_exit_status(SEXP status, SEXP name) {
   const char *cname = isNull(name) ? "???" : CHAR(STRING_ELT(name, 0));
   pid_t pid;
   int wstat, wp;
+  struct rusage ru;
   SEXP result;
 
   processx__block_sigchld();
@@ -851,13 +1266,13 @@ SEXP processx_get_exit_status(SEXP status, SEXP name) {
   /* Otherwise do a non-blocking waitpid to collect zombies */
   pid = handle->pid;
   do {
-    wp = waitpid(pid, &wstat, WNOHANG);
+    wp = wait4(pid, &wstat, WNOHANG, &ru);
   } while (wp == -1 && errno == EINTR);
 
   /* Another SIGCHLD handler already collected the exit code?
      Then we set it to NA (in the collect_exit_status call). */
   if (wp == -1 && errno == ECHILD) {
-    processx__collect_exit_status(status, wp, wstat);
+    processx__collect_exit_status(status, wp, wstat, &ru);
     result = PROTECT(ScalarInteger(handle->exitcode));
     goto cleanup;
   }
@@ -872,7 +1287,7 @@ SEXP processx_get_exit_status(SEXP status, SEXP name) {
   if (wp == 0) {
     result = PROTECT(R_NilValue);
   } else {
-    processx__collect_exit_status(status, wp, wstat);
+    processx__collect_exit_status(status, wp, wstat, &ru);
     result = PROTECT(ScalarInteger(handle->exitcode));
   }
 
@@ -882,6 +1297,99 @@ SEXP processx_get_exit_status(SEXP status, SEXP name) {
   return result;
 }
 
+/* Resource usage of a finished process, as reported by wait4(), when the
+   process was reaped. NULL if the process is running, or if it was
+   reaped by someone else. The R code adds the names. */
+
+SEXP processx_get_resource_usage(SEXP status) {
+  processx_handle_t *handle = R_ExternalPtrAddr(status);
+  struct rusage ru;
+  double *res;
+  SEXP result;
+
+  processx__block_sigchld();
+  if (!handle || !handle->has_rusage) {
+    processx__unblock_sigchld();
+    return R_NilValue;
+  }
+  ru = handle->rusage;
+  processx__unblock_sigchld();
+
+  result = PROTECT(allocVector(REALSXP, 9));
+  res = REAL(result);
+  res[0] = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+  res[1] = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+#ifdef __APPLE__
+  res[2] = ru.ru_maxrss;
+#else
+  res[2] = ru.ru_maxrss * 1024.0;
+#endif
+  res[3] = ru.ru_minflt;
+  res[4] = ru.ru_majflt;
+  res[5] = ru.ru_inblock;
+  res[6] = ru.ru_oublock;
+  res[7] = ru.ru_nvcsw;
+  res[8] = ru.ru_nivcsw;
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* Spawn latency, run time and reap latency of a process, in seconds.
+   NA if not known (yet). The run time of a running process is the time
+   since the exec(). */
+
+SEXP processx_get_timings(SEXP status) {
+  processx_handle_t *handle = R_ExternalPtrAddr(status);
+  int64_t spawn_ns, exec_ns, exit_ns, reap_ns, end_ns;
+  int collected;
+  SEXP result = PROTECT(allocVector(REALSXP, 3));
+  double *res = REAL(result);
+
+  res[0] = res[1] = res[2] = NA_REAL;
+  if (!handle) {
+    UNPROTECT(1);
+    return result;
+  }
+
+  processx__block_sigchld();
+  spawn_ns = handle->spawn_ns;
+  exec_ns = handle->exec_ns;
+  exit_ns = handle->exit_ns;
+  reap_ns = handle->reap_ns;
+  collected = handle->collected;
+  processx__unblock_sigchld();
+
+  end_ns = exit_ns ? exit_ns : reap_ns;
+  if (!collected) end_ns = processx__now_ns();
+  if (spawn_ns && exec_ns) res[0] = (exec_ns - spawn_ns) / 1e9;
+  if (exec_ns && end_ns) res[1] = (end_ns - exec_ns) / 1e9;
+  if (exit_ns && reap_ns) res[2] = (reap_ns - exit_ns) / 1e9;
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* Start reading standard output and error in the background, so the
+   process does not block on a full pipe. The connections read from the
+   background reader's buffers from now on. */
+
+SEXP processx_start_drain(SEXP status) {
+  processx_handle_t *handle = R_ExternalPtrAddr(status);
+  int i;
+
+  if (!handle) R_THROW_ERROR("Invalid handle, already finalized");
+
+  for (i = 1; i < 3; i++) {
+    processx_connection_t *ccon = handle->pipes[i];
+    if (ccon && !processx_c_connection_is_closed(ccon)) {
+      processx__drain_add(ccon, 0);
+    }
+  }
+
+  return R_NilValue;
+}
+
 /* See `processx_wait` above for the description of async processes and
  * possible race conditions.
  *
@@ -898,6 +1406,7 @@ SEXP processx_signal(SEXP status, SEXP signal, SEXP name) {
   const char *cname = isNull(name) ? "???" : CHAR(STRING_ELT(name, 0));
   pid_t pid;
   int wstat, wp, ret, result;
+  struct rusage ru;
 
   processx__block_sigchld();
 
@@ -912,9 +1421,9 @@ SEXP processx_signal(SEXP status, SEXP signal, SEXP name) {
     goto cleanup;
   }
 
-  /* Otherwise try to send signal */
+  /* Otherwise try to send signal, via the pidfd if we have one */
   pid = handle->pid;
-  ret = kill(pid, INTEGER(signal)[0]);
+  ret = processx__pidfd_send_signal(handle, INTEGER(signal)[0]);
 
   if (ret == 0) {
     result = 1;
@@ -928,12 +1437,12 @@ SEXP processx_signal(SEXP status, SEXP signal, SEXP name) {
 
   /* Possibly dead now, collect status */
   do {
-    wp = waitpid(pid, &wstat, WNOHANG);
+    wp = wait4(pid, &wstat, WNOHANG, &ru);
   } while (wp == -1 && errno == EINTR);
 
   /* Maybe another SIGCHLD handler collected it already? */
   if (wp == -1 && errno == ECHILD) {
-    processx__collect_exit_status(status, wp, wstat);
+    processx__collect_exit_status(status, wp, wstat, &ru);
     goto cleanup;
   }
 
@@ -967,6 +1476,7 @@ SEXP processx_kill(SEXP status, SEXP grace, SEXP name) {
   const char *cname = isNull(name) ? "???" : CHAR(STRING_ELT(name, 0));
   pid_t pid;
   int wstat, wp, result = 0;
+  struct rusage ru;
 
   processx__block_sigchld();
 
@@ -978,13 +1488,13 @@ SEXP processx_kill(SEXP status, SEXP grace, SEXP name) {
   /* Do a non-blocking waitpid to collect zombies */
   pid = handle->pid;
   do {
-    wp = waitpid(pid, &wstat, WNOHANG);
+    wp = wait4(pid, &wstat, WNOHANG, &ru);
   } while (wp == -1 && errno == EINTR);
 
   /* The child does not exist any more, set exit status to NA &
      return FALSE. */
   if (wp == -1 && errno == ECHILD) {
-    processx__collect_exit_status(status, wp, wstat);
+    processx__collect_exit_status(status, wp, wstat, &ru);
     goto cleanup;
   }
 
@@ -1007,7 +1517,7 @@ SEXP processx_kill(SEXP status, SEXP grace, SEXP name) {
 
   /* Do a waitpid to collect the status and reap the zombie */
   do {
-    wp = waitpid(pid, &wstat, 0);
+    wp = wait4(pid, &wstat, 0, &ru);
   } while (wp == -1 && errno == EINTR);
 
   /* Collect exit status, and check if it was killed by a SIGKILL
@@ -1015,7 +1525,7 @@ SEXP processx_kill(SEXP status, SEXP grace, SEXP name) {
      general...
      If the status was collected by another SIGCHLD, then the exit
      status will be set to NA */
-  processx__collect_exit_status(status, wp, wstat);
+  processx__collect_exit_status(status, wp, wstat, &ru);
   result = handle->exitcode == - SIGKILL;
 
  cleanup:
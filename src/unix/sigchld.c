@@ -3,13 +3,59 @@
 
 #include <errno.h>
 #include <pthread.h>
-
-extern processx__child_list_t *child_list;
+#include <sys/wait.h>
 
 static struct sigaction old_sig_handler = {{ 0 }};
 int processx__notify_old_sigchld_handler = 0;
 pthread_t processx__main_thread = { 0 };
 
+/* Check if a child has exited, and if yes, collect its exit status, and
+   remove it from the child table. Returns 1 if it has exited. `now` is
+   when the SIGCHLD signal arrived, our best guess for the exit time. */
+
+static int processx__sigchld_reap(processx__child_list_t *ptr, int64_t now) {
+  int wp, wstat;
+  struct rusage ru;
+  SEXP status;
+  processx_handle_t *handle;
+
+  /* Check if this child has exited */
+  do {
+    wp = wait4(ptr->pid, &wstat, WNOHANG, &ru);
+  } while (wp == -1 && errno == EINTR);
+
+  /* If it is still running (or an error, other than ECHILD happened),
+     we do nothing */
+  if (wp == 0 || (wp < 0 && errno != ECHILD)) return 0;
+
+  /* We deliberately do not call the finalizer here, because that
+     moves the exit code and pid to R, and we might have just checked
+     that these are not in R, before calling C. So finalizing here
+     would be a race condition.
+
+     OTOH, we need to check if the handle is null, because a finalizer
+     might actually run before the SIGCHLD handler. Or the finalizer
+     might even trigger the SIGCHLD handler...
+  */
+
+  status = R_WeakRefKey(ptr->weak_status);
+  handle = isNull(status) ? 0 : R_ExternalPtrAddr(status);
+
+  /* If waitpid errored with ECHILD, then the exit status is set to NA.
+     This also removes the child from the table, and closes the exit
+     pipe, so an active wait() or poll stops. */
+  if (handle && !handle->collected) {
+    if (wp > 0) handle->exit_ns = now;
+    processx__collect_exit_status(status, wp, wstat, &ru);
+  } else {
+    /* No handle any more, remove the child from the table, this does
+       not free memory */
+    processx__child_remove(ptr->pid);
+  }
+
+  return 1;
+}
+
 void processx__sigchld_callback(int sig, siginfo_t *info, void *ctx) {
 
   int saved_errno = errno;
@@ -34,63 +80,42 @@ void processx__sigchld_callback(int sig, siginfo_t *info, void *ctx) {
      (on some platforms at least) a single signal might be delivered
      for multiple children exiting around the same time. For example this
      happens if multiple SIGCHLD signals arrive while SIGCHLD is blocked.
-     So we need to iterate over all children to see which one has exited. */
-
-  processx__child_list_t *ptr = child_list->next;
-  processx__child_list_t *prev = child_list;
-
-  while (ptr) {
-    processx__child_list_t *next = ptr->next;
-    int wp, wstat;
-
-    /* Check if this child has exited */
-    do {
-      wp = waitpid(ptr->pid, &wstat, WNOHANG);
-    } while (wp == -1 && errno == EINTR);
-
-    if (wp == 0 || (wp < 0 && errno != ECHILD)) {
-      /* If it is still running (or an error, other than ECHILD happened),
-        we do nothing */
-      prev = ptr;
-      ptr = next;
-
-    } else {
-      /* Remove the child from the list */
-
-      /* We deliberately do not call the finalizer here, because that
-	 moves the exit code and pid to R, and we might have just checked
-	 that these are not in R, before calling C. So finalizing here
-	 would be a race condition.
-
-	 OTOH, we need to check if the handle is null, because a finalizer
-	 might actually run before the SIGCHLD handler. Or the finalizer
-	 might even trigger the SIGCHLD handler...
-      */
-
-      SEXP status = R_WeakRefKey(ptr->weak_status);
-      processx_handle_t *handle =
-	isNull(status) ? 0 : R_ExternalPtrAddr(status);
-
-      /* If waitpid errored with ECHILD, then the exit status is set to NA */
-      if (handle) processx__collect_exit_status(status, wp, wstat);
-
-      /* Defer freeing the memory, because malloc/free are typically not
-	 reentrant, and if we free in the SIGCHLD handler, that can cause
-	 crashes. The test case in test-run.R (see comments there)
-	 typically brings this out. */
-      processx__freelist_add(ptr);
-
-      /* If there is an active wait() with a timeout, then stop it */
-      if (handle && handle->waitpipe[1] >= 0) {
-	close(handle->waitpipe[1]);
-	handle->waitpipe[1] = -1;
-      }
-
-      /* If we remove the current list node, then prev stays the same,
-	 we only need to update ptr. */
-      prev->next = next;
-      ptr = next;
+     On Linux we ask the kernel which children have exited, with WNOWAIT,
+     so they stay zombies, and we can leave alone the ones that are not
+     ours. If we find a child that is not ours, then we fall back to
+     checking all of our children, like on other platforms. The fork
+     server is not in the child table, but we reap it here, so that its
+     zombie does not force this scan for every signal. Zombies of other
+     code in the R process still do, until that code reaps them. */
+
+  int scan = 1;
+  int64_t now = processx__now_ns();
+
+#ifdef __linux__
+  for (;;) {
+    siginfo_t si;
+    int ret;
+    processx__child_list_t *ptr;
+    si.si_pid = 0;
+    ret = waitid(P_ALL, 0, &si, WEXITED | WNOHANG | WNOWAIT);
+    if (ret == -1 && errno == EINTR) continue;
+
+    /* No more exited children, or no children at all */
+    if (ret == -1 || si.si_pid == 0) {
+      scan = 0;
+      break;
     }
+
+    ptr = processx__child_find(si.si_pid);
+    if (!ptr && processx__forkserver_reap(si.si_pid)) continue;
+    if (!ptr || !processx__sigchld_reap(ptr, now)) break;
+  }
+#endif
+
+  if (scan) {
+    processx__child_list_t *ptr;
+    size_t idx = 0;
+    while ((ptr = processx__child_next(&idx))) processx__sigchld_reap(ptr, now);
   }
 
   if (processx__notify_old_sigchld_handler) {
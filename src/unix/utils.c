@@ -3,6 +3,14 @@
 
 #include <termios.h>
 #include <sys/ioctl.h>
+#include <dirent.h>
+#include <time.h>
+
+#if defined(__linux__)
+#define PROCESSX__FD_DIR "/proc/self/fd"
+#else
+#define PROCESSX__FD_DIR "/dev/fd"
+#endif
 
 char *processx__tmp_string(SEXP str, int i) {
   const char *ptr = CHAR(STRING_ELT(str, i));
@@ -21,40 +29,66 @@ char **processx__tmp_character(SEXP chr) {
   return cchr;
 }
 
-int processx__nonblock_fcntl(int fd, int set) {
-  int flags;
-  int r;
-
-  do { r = fcntl(fd, F_GETFL); } while (r == -1 && errno == EINTR);
-  if (r == -1) { return -errno; }
-
-  /* Bail out now if already set/clear. */
-  if (!!(r & O_NONBLOCK) == !!set) { return 0; }
-
-  if (set) { flags = r | O_NONBLOCK; } else { flags = r & ~O_NONBLOCK; }
+/* Monotonic time in nanoseconds. This is async-signal-safe. */
 
-  do { r = fcntl(fd, F_SETFL, flags); } while (r == -1 && errno == EINTR);
-  if (r) { return -errno; }
-
-  return 0;
+int64_t processx__now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-int processx__cloexec_fcntl(int fd, int set) {
-  int flags;
-  int r;
-
-  do { r = fcntl(fd, F_GETFD); } while (r == -1 && errno == EINTR);
-  if (r == -1) { return -errno; }
+/* Set the CLOEXEC flag on all open fds, from `firstfd`. Returns the
+   number of open fds from `firstfd`, or -1 if we could not count them.
+
+   On Linux 5.11 and above, close_range() does it with a single system
+   call, and we only list /proc/self/fd for the count. Otherwise we list
+   the open fds and only touch those. /dev/fd is not always a complete
+   list, e.g. on FreeBSD without fdescfs, so we check that the fd of the
+   directory itself is in it. If not, then we try the fds one by one,
+   until the first error after fd 15. */
+
+int processx__cloexec_all_fds(int firstfd) {
+  int done = 0, count = 0, seen_self = 0, fd, dfd;
+  DIR *dir;
+  struct dirent *ent;
+  const char *c;
+
+#ifdef PROCESSX__NR_CLOSE_RANGE
+  done = syscall(PROCESSX__NR_CLOSE_RANGE, firstfd, ~0U,
+                 CLOSE_RANGE_CLOEXEC) == 0;
+#endif
 
-  /* Bail out now if already set/clear. */
-  if (!!(r & FD_CLOEXEC) == !!set) { return 0; }
+  dir = opendir(PROCESSX__FD_DIR);
+  if (dir) {
+    dfd = dirfd(dir);
+    while ((ent = readdir(dir)) != NULL) {
+      if (ent->d_name[0] < '0' || ent->d_name[0] > '9') continue;
+      for (fd = 0, c = ent->d_name; *c >= '0' && *c <= '9'; c++) {
+        fd = fd * 10 + (*c - '0');
+      }
+      if (fd == dfd) {
+        seen_self = 1;
+        continue;
+      }
+      if (fd < firstfd) continue;
+      if (done || processx__cloexec_fcntl(fd, 1) == 0) count++;
+    }
+    closedir(dir);
+    if (seen_self) return count;
+  }
 
-  if (set) { flags = r | FD_CLOEXEC; } else { flags = r & ~FD_CLOEXEC; }
+  if (done) return -1;
 
-  do { r = fcntl(fd, F_SETFD, flags); } while (r == -1 && errno == EINTR);
-  if (r) { return -errno; }
+  count = 0;
+  for (fd = firstfd; ; fd++) {
+    if (processx__cloexec_fcntl(fd, 1)) {
+      if (fd > 15) break;
+    } else {
+      count++;
+    }
+  }
 
-  return 0;
+  return count;
 }
 
 SEXP processx_disable_crash_dialog(void) {
@@ -14,6 +14,9 @@ typedef struct processx_handle_s {
   processx_connection_t *pipes[3];
   int cleanup;
   double create_time;
+  INT64 spawn_ns;		/* monotonic times, zero if unknown */
+  INT64 exec_ns;
+  INT64 reap_ns;
 } processx_handle_t;
 
 int processx__utf8_to_utf16_alloc(const char* s, WCHAR** ws_ptr);
@@ -32,9 +35,10 @@ int processx__create_input_pipe(void *id, HANDLE* parent_pipe_ptr, HANDLE* child
 
 void processx__handle_destroy(processx_handle_t *handle);
 
-void processx__stdio_noinherit(BYTE* buffer);
+int processx__stdio_noinherit(BYTE* buffer);
 int processx__stdio_verify(BYTE* buffer, WORD size);
 double processx__create_time(HANDLE process);
+INT64 processx__now_ns(void);
 extern HANDLE processx__connection_iocp;
 
 #endif
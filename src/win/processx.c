@@ -865,11 +865,18 @@ void processx__handle_destroy(processx_handle_t *handle) {
   free(handle);
 }
 
+SEXP processx_exec_many(SEXP commands, SEXP args, SEXP connections,
+                        SEXP env, SEXP privates, SEXP cleanup, SEXP wd,
+                        SEXP encoding, SEXP tree_ids) {
+  R_THROW_ERROR("Starting processes in a batch is not supported on Windows");
+  return R_NilValue;
+}
+
 SEXP processx_exec(SEXP command, SEXP args, SEXP pty, SEXP pty_options,
 		               SEXP connections, SEXP env, SEXP windows_verbatim_args,
                    SEXP windows_hide, SEXP windows_detached_process,
                    SEXP private, SEXP cleanup, SEXP wd, SEXP encoding,
-                   SEXP tree_id) {
+                   SEXP tree_id, SEXP async) {
 
   const char *ccommand = CHAR(STRING_ELT(command, 0));
   const char *cencoding = CHAR(STRING_ELT(encoding, 0));
@@ -1025,6 +1032,7 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP pty, SEXP pty_options,
     process_flags |= DETACHED_PROCESS;
   }
 
+  handle->spawn_ns = processx__now_ns();
   err = CreateProcessW(
     /* lpApplicationName =    */ application_path,
     /* lpCommandLine =        */ arguments,
@@ -1075,6 +1083,7 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP pty, SEXP pty_options,
   if (dwerr == (DWORD) -1) {
     R_THROW_SYSTEM_ERROR("resume thread for '%s'", ccommand);
   }
+  handle->exec_ns = processx__now_ns();
   CloseHandle(info.hThread);
 
   processx__stdio_destroy(handle->child_stdio_buffer);
@@ -1088,6 +1097,7 @@ void processx__collect_exit_status(SEXP status, DWORD exitcode) {
   processx_handle_t *handle = R_ExternalPtrAddr(status);
   handle->exitcode = exitcode;
   handle->collected = 1;
+  handle->reap_ns = processx__now_ns();
 }
 
 SEXP processx_wait(SEXP status, SEXP timeout, SEXP name) {
@@ -1129,6 +1139,103 @@ SEXP processx_wait(SEXP status, SEXP timeout, SEXP name) {
   return ScalarLogical(TRUE);
 }
 
+/* Wait until any or all of several processes exit. At most
+   MAXIMUM_WAIT_OBJECTS handles can be waited on at once, the rest are
+   checked after every interrupt interval. */
+
+SEXP processx_wait_many(SEXP statuses, SEXP all, SEXP timeout) {
+  int i, k, n = LENGTH(statuses);
+  int call = LOGICAL(all)[0];
+  int ctimeout = INTEGER(timeout)[0];
+  int *done = (int*) R_alloc(n, sizeof(int));
+  HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+  int ndone = 0, nhandles;
+  ULONGLONG start = GetTickCount64();
+  SEXP result;
+
+  for (;;) {
+    DWORD wait, ret;
+    ndone = 0;
+    nhandles = 0;
+    for (i = 0; i < n; i++) {
+      processx_handle_t *handle = R_ExternalPtrAddr(VECTOR_ELT(statuses, i));
+      done[i] = !handle || handle->collected ||
+        WaitForSingleObject(handle->hProcess, 0) == WAIT_OBJECT_0;
+      if (done[i]) {
+        ndone++;
+      } else if (nhandles < MAXIMUM_WAIT_OBJECTS) {
+        handles[nhandles++] = handle->hProcess;
+      }
+    }
+
+    if (ndone == n || (!call && ndone > 0)) break;
+
+    wait = PROCESSX_INTERRUPT_INTERVAL;
+    if (ctimeout >= 0) {
+      ULONGLONG elapsed = GetTickCount64() - start;
+      if (elapsed >= (ULONGLONG) ctimeout) break;
+      if (ctimeout - elapsed < wait) wait = (DWORD) (ctimeout - elapsed);
+    }
+
+    ret = WaitForMultipleObjects(nhandles, handles, FALSE, wait);
+    if (ret == WAIT_FAILED) {
+      R_THROW_SYSTEM_ERROR("failed to wait on processes");
+    }
+    R_CheckUserInterrupt();
+  }
+
+  result = PROTECT(allocVector(INTSXP, ndone));
+  for (i = 0, k = 0; i < n; i++) {
+    if (done[i]) INTEGER(result)[k++] = i + 1;
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* CreateProcess() is synchronous, so processes are always started
+   already. `async` is ignored in processx_exec(). */
+
+SEXP processx_start_status(SEXP status, SEXP name) {
+  return ScalarLogical(1);
+}
+
+static int processx__pre_poll_func_start(processx_pollable_t *pollable) {
+  return PXREADY;
+}
+
+int processx_c_pollable_from_start(processx_pollable_t *pollable,
+                                   processx_handle_t *handle) {
+  pollable->pre_poll_func = processx__pre_poll_func_start;
+  pollable->object = handle;
+  pollable->free = 0;
+  pollable->fds = R_NilValue;
+  return 0;
+}
+
+/* Process handles cannot be added to the IOCP, so the poll loop checks
+   them every PROCESSX_INTERRUPT_INTERVAL ms. */
+
+int processx_i_pre_poll_func_exit(processx_pollable_t *pollable) {
+  processx_handle_t *handle = pollable->object;
+  if (!handle) return PXCLOSED;
+  if (handle->collected) return PXEXIT;
+  if (WaitForSingleObject(handle->hProcess, 0) == WAIT_OBJECT_0) {
+    return PXEXIT;
+  }
+  pollable->handle = handle->hProcess;
+  return PXHANDLE;
+}
+
+int processx_c_pollable_from_exit(processx_pollable_t *pollable,
+                                  processx_handle_t *handle) {
+  pollable->pre_poll_func = processx_i_pre_poll_func_exit;
+  pollable->object = handle;
+  pollable->free = 0;
+  pollable->fds = R_NilValue;
+  return 0;
+}
+
 SEXP processx_is_alive(SEXP status, SEXP name) {
   processx_handle_t *handle = R_ExternalPtrAddr(status);
   const char *cname = isNull(name) ? "???" : CHAR(STRING_ELT(name, 0));
@@ -1178,6 +1285,74 @@ SEXP processx_get_exit_status(SEXP status, SEXP name) {
   }
 }
 
+/* Resource usage of a finished process. Windows does not report the
+   page faults and context switches of another process, and we use the
+   I/O operation counts instead of the block counts. */
+
+SEXP processx_get_resource_usage(SEXP status) {
+  processx_handle_t *handle = R_ExternalPtrAddr(status);
+  FILETIME ftCreate, ftExit, ftKernel, ftUser;
+  IO_COUNTERS io;
+  double *res;
+  SEXP result;
+  int i;
+
+  if (!handle || !handle->collected) return R_NilValue;
+
+  if (!GetProcessTimes(handle->hProcess, &ftCreate, &ftExit, &ftKernel,
+                       &ftUser)) {
+    R_THROW_SYSTEM_ERROR("cannot get process times");
+  }
+
+  result = PROTECT(allocVector(REALSXP, 9));
+  res = REAL(result);
+  for (i = 0; i < 9; i++) res[i] = NA_REAL;
+  res[0] = (((ULONGLONG) ftUser.dwHighDateTime << 32) +
+            ftUser.dwLowDateTime) / 1e7;
+  res[1] = (((ULONGLONG) ftKernel.dwHighDateTime << 32) +
+            ftKernel.dwLowDateTime) / 1e7;
+  if (GetProcessIoCounters(handle->hProcess, &io)) {
+    res[5] = (double) io.ReadOperationCount;
+    res[6] = (double) io.WriteOperationCount;
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* Spawn latency, run time and reap latency of a process, in seconds.
+   We only know when we noticed the exit of the process, so the reap
+   latency is always NA on Windows. */
+
+SEXP processx_get_timings(SEXP status) {
+  processx_handle_t *handle = R_ExternalPtrAddr(status);
+  SEXP result = PROTECT(allocVector(REALSXP, 3));
+  double *res = REAL(result);
+  INT64 end_ns;
+
+  res[0] = res[1] = res[2] = NA_REAL;
+  if (!handle) {
+    UNPROTECT(1);
+    return result;
+  }
+
+  end_ns = handle->collected ? handle->reap_ns : processx__now_ns();
+  if (handle->spawn_ns && handle->exec_ns) {
+    res[0] = (handle->exec_ns - handle->spawn_ns) / 1e9;
+  }
+  if (handle->exec_ns && end_ns) {
+    res[1] = (end_ns - handle->exec_ns) / 1e9;
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
+SEXP processx_start_drain(SEXP status) {
+  R_THROW_ERROR("Background reading is not supported on Windows");
+  return R_NilValue;
+}
+
 SEXP processx_signal(SEXP status, SEXP signal, SEXP name) {
   processx_handle_t *handle = R_ExternalPtrAddr(status);
   const char *cname = isNull(name) ? "???" : CHAR(STRING_ELT(name, 0));
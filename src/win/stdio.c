@@ -438,16 +438,18 @@ void processx__stdio_destroy(BYTE* buffer) {
   free(buffer);
 }
 
-void processx__stdio_noinherit(BYTE* buffer) {
-  int i, count;
+int processx__stdio_noinherit(BYTE* buffer) {
+  int i, count, done = 0;
 
   count = CHILD_STDIO_COUNT(buffer);
   for (i = 0; i < count; i++) {
     HANDLE handle = CHILD_STDIO_HANDLE(buffer, i);
     if (handle != INVALID_HANDLE_VALUE) {
-      SetHandleInformation(handle, HANDLE_FLAG_INHERIT, 0);
+      if (SetHandleInformation(handle, HANDLE_FLAG_INHERIT, 0)) done++;
     }
   }
+
+  return done;
 }
 
 int processx__stdio_verify(BYTE* buffer, WORD size) {
@@ -16,7 +16,31 @@ SEXP processx__echo_off(void) {
   return R_NilValue;
 }
 
+SEXP processx_forkserver_start(SEXP path) {
+  R_THROW_ERROR("The processx fork server is only supported on Linux");
+  return R_NilValue;
+}
+
+SEXP processx_forkserver_stop(void) {
+  return R_NilValue;
+}
+
+SEXP processx_forkserver_pid(void) {
+  return R_NilValue;
+}
+
 SEXP processx_make_fifo(SEXP name) {
   /* TODO */
   return R_NilValue;
 }
+
+/* Monotonic time in nanoseconds */
+
+INT64 processx__now_ns(void) {
+  static LARGE_INTEGER freq = { 0 };
+  LARGE_INTEGER now;
+  if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (INT64) (now.QuadPart / freq.QuadPart) * 1000000000 +
+    (INT64) (now.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
+}